@@ -14,6 +14,13 @@ CSRCS = \
        src/init.c \
        src/board_io.c \
        src/bulk_sampling.c \
+       src/profile.c \
+       src/twi_queue.c \
+       src/dac_queue.c \
+       src/power_monitor.c \
+       src/calibration.c \
+       src/crc32.c \
+       src/iap.c \
        common/services/clock/sam3u/sysclk.c               \
        common/services/delay/sam/cycle_counter.c          \
        common/services/sleepmgr/sam/sleepmgr.c            \
@@ -0,0 +1,159 @@
+// Measures streaming throughput and round-trip latency for each bulk packet
+// size supported by request 0xC6.
+//
+// Round-trip latency is the time from submitting OUT chunk k to receiving
+// IN chunk k, which holds the samples measured while chunk k was played.
+//
+// usage: benchchunk [period in 48MHz ticks] [seconds per size]
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <vector>
+#include <string.h>
+#include <stdlib.h>
+#include <libusb-1.0/libusb.h>
+
+#include "transfers.h"
+
+typedef std::chrono::steady_clock Clock;
+
+extern "C" void LIBUSB_CALL bench_in_completion(libusb_transfer *t);
+extern "C" void LIBUSB_CALL bench_out_completion(libusb_transfer *t);
+
+struct ChunkBench {
+	ChunkBench(libusb_device_handle* handle, unsigned chunk): m_usb(handle), m_chunk(chunk) {}
+
+	void run(uint16_t period, double seconds) {
+		uint8_t buf[4];
+		libusb_control_transfer(m_usb, 0x40|0x80, 0xC5, 0, 0, buf, 1, 100);
+		if (libusb_control_transfer(m_usb, 0x40, 0xC6, m_chunk, 0, NULL, 0, 100) < 0) {
+			std::cerr << "chunk size " << m_chunk << " rejected" << std::endl;
+			return;
+		}
+
+		m_in_transfers.alloc(8, m_usb, 0x81, LIBUSB_TRANSFER_TYPE_BULK, m_chunk*8, 1000, bench_in_completion, this);
+		m_out_transfers.alloc(8, m_usb, 0x02, LIBUSB_TRANSFER_TYPE_BULK, m_chunk*4, 1000, bench_out_completion, this);
+		libusb_control_transfer(m_usb, 0x40|0x80, 0xC5, period, 0, buf, 1, 100);
+
+		m_start = Clock::now();
+		m_deadline = m_start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+		for (auto t: m_out_transfers) {
+			memset(t->buffer, 0, t->length);
+			submit_out(t);
+		}
+		for (auto t: m_in_transfers) {
+			submit_in(t);
+		}
+
+		while (m_in_flight > 0) {
+			libusb_handle_events(NULL);
+		}
+		libusb_control_transfer(m_usb, 0x40|0x80, 0xC5, 0, 0, buf, 1, 100);
+		report(period);
+	}
+
+	void submit_out(libusb_transfer* t) {
+		if (Clock::now() >= m_deadline) return;
+		m_out_time.push_back(Clock::now());
+		if (libusb_submit_transfer(t) == 0) m_in_flight++;
+	}
+
+	void submit_in(libusb_transfer* t) {
+		if (Clock::now() >= m_deadline) return;
+		if (libusb_submit_transfer(t) == 0) m_in_flight++;
+	}
+
+	void handle_in(libusb_transfer* t) {
+		m_in_flight--;
+		if (t->status != LIBUSB_TRANSFER_COMPLETED) {
+			m_errors++;
+			return;
+		}
+		auto now = Clock::now();
+		if (m_in_chunks < m_out_time.size()) {
+			double us = std::chrono::duration<double, std::micro>(now - m_out_time[m_in_chunks]).count();
+			m_latency_sum += us;
+			if (us > m_latency_max) m_latency_max = us;
+		}
+		m_in_chunks++;
+		m_in_bytes += t->actual_length;
+		m_end = now;
+		submit_in(t);
+	}
+
+	void handle_out(libusb_transfer* t) {
+		m_in_flight--;
+		if (t->status != LIBUSB_TRANSFER_COMPLETED) {
+			m_errors++;
+			return;
+		}
+		submit_out(t);
+	}
+
+	void report(uint16_t period) {
+		double secs = std::chrono::duration<double>(m_end - m_start).count();
+		// the timer interrupt alternates channels, so a sample takes two periods
+		double expected = 24e6 / period;
+		double rate = m_in_chunks * m_chunk / secs;
+		std::cout << std::setw(6) << m_chunk
+		          << std::setw(12) << std::fixed << std::setprecision(0) << rate
+		          << std::setw(10) << std::setprecision(1) << 100.0 * rate / expected << "%"
+		          << std::setw(10) << std::setprecision(2) << m_in_bytes / secs / 1e6
+		          << std::setw(12) << std::setprecision(0) << (m_in_chunks ? m_latency_sum / m_in_chunks : 0)
+		          << std::setw(12) << m_latency_max
+		          << std::setw(8) << m_errors << std::endl;
+	}
+
+	libusb_device_handle* const m_usb;
+	const unsigned m_chunk;
+	Transfers m_in_transfers;
+	Transfers m_out_transfers;
+
+	Clock::time_point m_start, m_end, m_deadline;
+	std::vector<Clock::time_point> m_out_time;
+	unsigned m_in_flight = 0;
+	uint64_t m_in_chunks = 0;
+	uint64_t m_in_bytes = 0;
+	unsigned m_errors = 0;
+	double m_latency_sum = 0;
+	double m_latency_max = 0;
+};
+
+extern "C" void LIBUSB_CALL bench_in_completion(libusb_transfer *t) {
+	((ChunkBench*) t->user_data)->handle_in(t);
+}
+
+extern "C" void LIBUSB_CALL bench_out_completion(libusb_transfer *t) {
+	((ChunkBench*) t->user_data)->handle_out(t);
+}
+
+int main(int argc, char** argv)
+{
+	uint16_t period = argc > 1 ? atoi(argv[1]) : 480;
+	double seconds = argc > 2 ? atof(argv[2]) : 5.0;
+
+	if (libusb_init(NULL) < 0) {
+		std::cerr << "Could not init libusb" << std::endl;
+		abort();
+	}
+
+	libusb_device_handle* handle = libusb_open_device_with_vid_pid(NULL, 0x064B, 0x784C);
+	if (!handle) handle = libusb_open_device_with_vid_pid(NULL, 0x0456, 0xCEE2);
+	if (!handle) {
+		std::cerr << "Device not found" << std::endl;
+		return 1;
+	}
+	libusb_claim_interface(handle, 0);
+	libusb_set_interface_alt_setting(handle, 0, 1);
+
+	std::cout << " chunk   samples/s  of-rate      MB/s  latency-us      max-us  errors" << std::endl;
+	for (unsigned chunk: {32, 64, 128, 256, 448}) {
+		ChunkBench bench(handle, chunk);
+		bench.run(period, seconds);
+	}
+
+	libusb_release_interface(handle, 0);
+	libusb_close(handle);
+	libusb_exit(NULL);
+}
@@ -0,0 +1,71 @@
+// Time to configure the device for a test step: the usual setup requests
+// sent one control transfer each, against the same list in one 0x78 command
+// list plus its 0x79 status read.
+//
+// usage: benchconfig [repetitions]
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <stdlib.h>
+#include <libusb-1.0/libusb.h>
+
+#include "stream_device.h"
+
+typedef std::chrono::steady_clock Clock;
+
+int main(int argc, char** argv)
+{
+	int reps = argc > 1 ? atoi(argv[1]) : 100;
+
+	if (libusb_init(NULL) < 0) {
+		std::cerr << "Could not init libusb" << std::endl;
+		abort();
+	}
+
+	libusb_device_handle* handle = libusb_open_device_with_vid_pid(NULL, 0x064B, 0x784C);
+	if (!handle) handle = libusb_open_device_with_vid_pid(NULL, 0x0456, 0xCEE2);
+	if (!handle) {
+		std::cerr << "Device not found" << std::endl;
+		return 1;
+	}
+
+	// both channels SVMI with their pots, PIO0-3 low, planar packets, 256-sample chunks
+	const std::vector<Command> setup = {
+		{0xC5, 0, 0},
+		{0x53, 0, 1}, {0x53, 1, 1},
+		{0x59, 0, 0x3030}, {0x59, 1, 0x3030},
+		{0x50, 0, 0}, {0x50, 1, 0}, {0x50, 2, 0}, {0x50, 3, 0},
+		{0xDD, 0, 0},
+		{0xC6, 256, 0},
+	};
+
+	StreamDevice dev(handle);
+	dev.claim();
+
+	auto start = Clock::now();
+	for (int r = 0; r < reps; r++) {
+		for (auto& c: setup) {
+			libusb_control_transfer(handle, 0x40, c.request, c.value, c.index, NULL, 0, 100);
+		}
+	}
+	double single = std::chrono::duration<double, std::milli>(Clock::now() - start).count() / reps;
+
+	int failed = -1;
+	start = Clock::now();
+	for (int r = 0; r < reps && failed < 0; r++) {
+		failed = dev.commands(setup);
+	}
+	double batched = std::chrono::duration<double, std::milli>(Clock::now() - start).count() / reps;
+
+	std::cout << std::fixed << std::setprecision(3)
+	          << setup.size() << " requests\n"
+	          << "one transfer each  " << single << " ms\n"
+	          << "command list       " << batched << " ms\n";
+	if (failed >= 0) std::cout << "request " << failed << " failed\n";
+
+	dev.release();
+	libusb_close(handle);
+	libusb_exit(NULL);
+	return failed >= 0 ? 2 : 0;
+}
@@ -0,0 +1,120 @@
+// Sustained continuous streaming through StreamDevice.
+//
+// Streams a constant output for the given time and reports the achieved
+// sample rate, chunks the device dropped or replayed, how far the SPSC
+// rings backed up, and the device's own counters from request 0x57.
+// Firmware built with PROFILE=1 also reports cycles spent in the sampling
+// ISR, SOF handler and main loop, and the wait for the bulk transfer
+// interrupt (request 0x77), and exits with 3 if the ISR ever took longer
+// than its budget of 2*period cycles.
+//
+// usage: benchstream [period in 48MHz ticks] [seconds] [chunk] [sink work in ns/sample]
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <stdlib.h>
+#include <libusb-1.0/libusb.h>
+
+#include "stream_device.h"
+
+typedef std::chrono::steady_clock Clock;
+
+int main(int argc, char** argv)
+{
+	StreamConfig config;
+	config.period = argc > 1 ? atoi(argv[1]) : 480;
+	double seconds = argc > 2 ? atof(argv[2]) : 10.0;
+	config.chunk = argc > 3 ? atoi(argv[3]) : 256;
+	// simulated per-sample processing cost, to show backpressure
+	unsigned work_ns = argc > 4 ? atoi(argv[4]) : 0;
+
+	if (libusb_init(NULL) < 0) {
+		std::cerr << "Could not init libusb" << std::endl;
+		abort();
+	}
+
+	libusb_device_handle* handle = libusb_open_device_with_vid_pid(NULL, 0x064B, 0x784C);
+	if (!handle) handle = libusb_open_device_with_vid_pid(NULL, 0x0456, 0xCEE2);
+	if (!handle) {
+		std::cerr << "Device not found" << std::endl;
+		return 1;
+	}
+
+	uint64_t checksum = 0;
+	auto source = [](uint64_t sampleno, uint16_t* a, uint16_t* b, size_t count) {
+		for (size_t i = 0; i < count; i++) a[i] = b[i] = 0;
+	};
+	auto sink = [&](const Samples& s) {
+		for (size_t i = 0; i < s.count; i++) checksum += s.v_a[i] + s.i_a[i] + s.v_b[i] + s.i_b[i];
+		if (work_ns) {
+			auto until = Clock::now() + std::chrono::nanoseconds(work_ns * s.count);
+			while (Clock::now() < until) {}
+		}
+		return true;
+	};
+
+	StreamDevice dev(handle);
+	dev.claim();
+	uint8_t stats[28];
+	libusb_control_transfer(handle, 0x40|0x80, 0x57, 1, 0, stats, sizeof(stats), 100);
+	const int probes = 5;
+	uint8_t profile[probes][64];
+	for (int p = 0; p < probes; p++) {
+		libusb_control_transfer(handle, 0x40|0x80, 0x77, 1, p, profile[p], sizeof(profile[p]), 100);
+	}
+
+	auto start = Clock::now();
+	if (!dev.start(config, source, sink)) return 1;
+	std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+	auto c = dev.counters();
+	double secs = std::chrono::duration<double>(Clock::now() - start).count();
+	bool profiled[probes];
+	for (int p = 0; p < probes; p++) {
+		profiled[p] = libusb_control_transfer(handle, 0x40|0x80, 0x77, 0, p, profile[p], sizeof(profile[p]), 100) == 64;
+	}
+	dev.stop();
+
+	int r = libusb_control_transfer(handle, 0x40|0x80, 0x57, 0, 0, stats, sizeof(stats), 100);
+	dev.release();
+
+	// the timer interrupt alternates channels, so a sample takes two periods
+	double expected = 24e6 / config.period;
+	std::cout << std::fixed << std::setprecision(0)
+	          << "samples/s       " << c.in_samples / secs << " (" << std::setprecision(1)
+	          << 100.0 * c.in_samples / secs / expected << "% of " << std::setprecision(0) << expected << ")\n"
+	          << "in samples      " << c.in_samples << "\n"
+	          << "out samples     " << c.out_samples << "\n"
+	          << "lost chunks     " << c.lost_chunks << "\n"
+	          << "stale chunks    " << c.stale_chunks << "\n"
+	          << "underrun chunks " << c.underrun_chunks << "\n"
+	          << "transfer errors " << c.transfer_errors << "\n"
+	          << "in ring max     " << c.in_ring_high_water << "/" << config.in_transfers << "\n"
+	          << "out ring max    " << c.out_ring_high_water << "/" << config.out_transfers << "\n";
+	if (r == sizeof(stats)) {
+		auto word = [&](int i) { return stats[i*4] | stats[i*4+1]<<8 | stats[i*4+2]<<16 | (uint32_t)stats[i*4+3]<<24; };
+		std::cout << "device          in overruns " << word(2) << ", out underruns " << word(3)
+		          << ", isr latency max " << word(6) << " ticks\n";
+	}
+	bool over_budget = false;
+	const char* names[probes] = {"isr cycles     ", "sof cycles     ", "loop cycles    ", "cal cycles     ", "bulk wait      "};
+	for (int p = 0; p < probes; p++) {
+		auto word = [&](int i) { return profile[p][i*4] | profile[p][i*4+1]<<8 | profile[p][i*4+2]<<16 | (uint32_t)profile[p][i*4+3]<<24; };
+		// probes that never fired, such as calibration while it's off
+		if (profiled[p] && word(0)) {
+			std::cout << names[p] << " min " << word(1) << ", max " << word(2) << " in " << word(0) << " samples";
+			// 96MHz core, 48MHz timer ticks
+			if (p == 0) {
+				std::cout << " (budget " << 2 * config.period << ")";
+				over_budget = word(2) > 2u * config.period;
+			}
+			std::cout << "\n";
+		}
+	}
+	std::cerr << "checksum " << checksum << std::endl;
+
+	libusb_close(handle);
+	libusb_exit(NULL);
+	if (over_budget) return 3;
+	return (c.lost_chunks || c.underrun_chunks) ? 2 : 0;
+}
@@ -0,0 +1,143 @@
+// Microbenchmark for the IN packet unpack kernels in unpack.cpp.
+//
+// Each kernel is first checked against the scalar path, and unpack_float()
+// against the device's fixed-point conversion, then timed on a cache-resident
+// packet, repeating until the minimum run time is reached,
+// in the manner of Google Benchmark's fixed-time loops.
+//
+// usage: benchunpack [samples per packet] [seconds per case]
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "unpack.h"
+
+typedef std::chrono::steady_clock Clock;
+
+struct Planes {
+	Planes(size_t n): u16(4, std::vector<uint16_t>(n)), f32(4, std::vector<float>(n)) {
+		for (size_t k = 0; k < 4; k++) {
+			u[k] = &u16[k][0];
+			f[k] = &f32[k][0];
+		}
+	}
+	std::vector<std::vector<uint16_t>> u16;
+	std::vector<std::vector<float>> f32;
+	uint16_t* u[4];
+	float* f[4];
+};
+
+// keeps the optimiser from discarding the kernels' output
+static volatile uint32_t sink;
+
+/// calibration_convert() in the firmware, for one code
+static int32_t device_convert(const CalEntry& e, uint16_t code) {
+	int32_t d = (int32_t) code * (1 << 15) - e.offset * 128;
+	int32_t gain = (d >= 0) ? e.gain_pos : e.gain_neg;
+	return (int32_t) (((int64_t) d * gain) >> 31);
+}
+
+template<typename F>
+static double time_case(F run, double seconds) {
+	// warm up, then time batches until the budget is spent
+	run();
+	uint64_t iters = 0;
+	auto start = Clock::now();
+	auto deadline = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+	Clock::time_point now;
+	do {
+		for (int i = 0; i < 64; i++) run();
+		iters += 64;
+		now = Clock::now();
+	} while (now < deadline);
+	return std::chrono::duration<double, std::nano>(now - start).count() / iters;
+}
+
+int main(int argc, char** argv)
+{
+	const size_t n = argc > 1 ? atoi(argv[1]) : 256;
+	const double seconds = argc > 2 ? atof(argv[2]) : 0.5;
+	if (n == 0 || n > UNPACK_MAX_SAMPLES) {
+		std::cerr << "samples must be 1-" << UNPACK_MAX_SAMPLES << std::endl;
+		return 1;
+	}
+
+	std::vector<uint8_t> packet(n*8);
+	srand(1);
+	for (auto& b: packet) b = rand();
+	// 5V and 400mA spans; currents centred, with a different gain each way
+	const CalEntry v = {12*256 + 77, (int32_t) (5e6/65536 * 65536), (int32_t) (5e6/65536 * 65536)};
+	const CalEntry i = {32768*256 - 140, (int32_t) (4e5/65536 * 65536), (int32_t) (4.1e5/65536 * 65536)};
+	const CalEntry* const cal[4] = {&v, &i, &v, &i};
+
+	const UnpackKernels* scalar = unpack_kernels(UNPACK_SCALAR);
+	Planes ref(n), out(n);
+	int failures = 0;
+
+	std::cout << "packet of " << n << " samples, best kernels: " << unpack_best().name << "\n\n"
+	          << "case                          ns/packet   Msample/s   speedup\n";
+
+	for (int layout = 0; layout < 2; layout++) {
+		const char* layout_name = layout ? "interleaved" : "planar";
+		auto pick = [&](const UnpackKernels* k) { return layout ? k->interleaved : k->planar; };
+		double base_u16 = 0, base_f32 = 0;
+
+		for (int isa = 0; isa < UNPACK_ISA_COUNT; isa++) {
+			const UnpackKernels* k = unpack_kernels((UnpackIsa) isa);
+			if (!k) continue;
+			unpack_fn fn = pick(k);
+
+			// correctness against the scalar reference
+			pick(scalar)(&packet[0], n, ref.u);
+			for (size_t p = 0; p < 4; p++) memset(out.u[p], 0, n*2);
+			fn(&packet[0], n, out.u);
+			for (size_t p = 0; p < 4; p++) {
+				if (memcmp(ref.u[p], out.u[p], n*2)) {
+					std::cout << k->name << " " << layout_name << ": MISMATCH in plane " << p << "\n";
+					failures++;
+				}
+			}
+
+			// within float rounding of the device, which also rounds down
+			unpack_float(fn, &packet[0], n, cal, out.f);
+			for (size_t p = 0; p < 4; p++) {
+				for (size_t s = 0; s < n; s++) {
+					double want = device_convert(*cal[p], ref.u[p][s]);
+					if (fabs(out.f[p][s] - want) > 1 + fabs(want)*1e-6) {
+						std::cout << k->name << " " << layout_name << "/float: " << out.f[p][s]
+						          << " for code " << ref.u[p][s] << ", device " << want << "\n";
+						failures++;
+						break;
+					}
+				}
+			}
+
+			double ns = time_case([&]() { fn(&packet[0], n, out.u); sink = out.u[3][n-1]; }, seconds);
+			double ns_f = time_case([&]() {
+				unpack_float(fn, &packet[0], n, cal, out.f);
+				sink = (uint32_t) out.f[3][n-1];
+			}, seconds);
+			if (isa == UNPACK_SCALAR) {
+				base_u16 = ns;
+				base_f32 = ns_f;
+			}
+
+			std::string name = std::string(layout_name) + "/" + k->name;
+			std::cout << std::fixed << std::left << std::setw(28) << name << std::right
+			          << std::setw(11) << std::setprecision(1) << ns
+			          << std::setw(12) << std::setprecision(1) << n * 1e3 / ns
+			          << std::setw(9) << std::setprecision(2) << base_u16 / ns << "x\n"
+			          << std::left << std::setw(28) << name + "/float" << std::right
+			          << std::setw(11) << std::setprecision(1) << ns_f
+			          << std::setw(12) << std::setprecision(1) << n * 1e3 / ns_f
+			          << std::setw(9) << std::setprecision(2) << base_f32 / ns_f << "x\n";
+		}
+	}
+	return failures ? 1 : 0;
+}
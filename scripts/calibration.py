@@ -0,0 +1,56 @@
+#!/usr/bin/env python
+# Read or write the calibration table kept in the device's flash.
+#
+#   calibration.py            print the table
+#   calibration.py write f    write the table from f: eight lines of
+#                             "offset gain_pos gain_neg", in codes and uV or
+#                             uA per code, in the order of src/calibration.h
+#
+# Needs firmware with requests 0x7E/0x7F, and the device not streaming.
+import usb, struct, sys
+
+PATHS = ["A measure V", "A measure I", "A source V", "A source I",
+         "B measure V", "B measure I", "B source V", "B source I"]
+MAGIC = 0x314C4143
+ENTRY = struct.Struct("<3i")
+
+# offsets are Q24.8, gains Q16.16
+SCALE = (256.0, 65536.0, 65536.0)
+
+def fixed(row):
+	return [int(round(float(x) * s)) for x, s in zip(row, SCALE)]
+
+def read(dev):
+	try:
+		data = bytearray(dev.ctrl_transfer(0x40|0x80, 0x7E, 0, 0, 8 + ENTRY.size*len(PATHS) + 4))
+	except usb.core.USBError:
+		return None
+	magic, seq = struct.unpack_from("<2I", data)
+	if magic != MAGIC:
+		return None
+	return seq, [ENTRY.unpack_from(data, 8 + ENTRY.size*i) for i in range(len(PATHS))]
+
+def write(dev, rows):
+	data = b"".join(ENTRY.pack(*fixed(row)) for row in rows)
+	dev.ctrl_transfer(0x40, 0x7F, 0, 0, data)
+
+dev = usb.core.find(idVendor=0x0456, idProduct=0xcee2)
+dev.set_interface_altsetting(0, 1)
+
+if len(sys.argv) > 2 and sys.argv[1] == "write":
+	rows = [line.split() for line in open(sys.argv[2]) if line.strip() and not line.startswith("#")]
+	if len(rows) != len(PATHS) or any(len(r) != 3 for r in rows):
+		sys.exit("expected %d lines of offset gain_pos gain_neg" % len(PATHS))
+	before = read(dev)
+	write(dev, rows)
+	after = read(dev)
+	# the write is checked on the device; a new sequence number means it took
+	if after is None or (before is not None and after[0] == before[0]):
+		sys.exit("write failed")
+
+table = read(dev)
+if table is None:
+	sys.exit("no calibration table on the device")
+print("sequence %d" % table[0])
+for name, (offset, gain_pos, gain_neg) in zip(PATHS, table[1]):
+	print("%-12s offset %10.3f  gain %10.4f / %10.4f" % (name, offset/SCALE[0], gain_pos/SCALE[1], gain_neg/SCALE[2]))
@@ -0,0 +1,450 @@
+#!/usr/bin/env python3
+# Stand-in for the SAM-BA monitor in the SAM3U boot ROM, to try sam-ba.py
+# without boards:
+#
+#   sam-ba-sim.py [-n boards] [-p ms] [-f prefix] [-v] socket
+#   SAMBA_SIM_SOCKET=socket python scripts/sam-ba.py m1000.bin
+#
+# Each board listens on socket.0, socket.1, ... in its own process and
+# models the monitor's binary (N) and terminal (T) modes, 128KB of flash
+# behind EEFC0 with its page latch and GPNVM bits, both SRAM banks, and a
+# reset through RSTC_CR. G runs the uploaded code on a 16-bit Thumb
+# interpreter, so sam-ba.py's applet runs here as it would on the part.
+# A page write keeps FRDY low for -p ms (default 4). With -f, each board's
+# flash is loaded from and saved to prefix.N.bin.
+import getopt, multiprocessing, os, signal, socket, sys, time
+
+FLASH_BASE, FLASH_SIZE, PAGE = 0x00080000, 0x20000, 256
+SRAM = [(0x20000000, 0x4000), (0x20080000, 0x4000)]
+EEFC0, RSTC_CR = 0x400E0800, 0x400E1200
+FSR_FRDY, FSR_FCMDE = 1, 2
+MONITOR_RETURN = 0xFFFFFFFE       # LR for G; the applet returning ends it
+MONITOR_SP = 0x20003F00
+STEP_LIMIT = 50000000
+
+class Fault(Exception):
+	pass
+
+class Reset(Exception):
+	pass
+
+class Board:
+	def __init__(self, index, page_ms, path, verbose):
+		self.index, self.page_ms, self.path, self.verbose = index, page_ms, path, verbose
+		self.flash = bytearray(b"\xff" * FLASH_SIZE)
+		if path and os.path.exists(path):
+			data = open(path, "rb").read()
+			self.flash[:len(data)] = data
+		self.sram = [bytearray(size) for _, size in SRAM]
+		# 16KB banks by address >> 14, for the applet's loads
+		self.banks = {(FLASH_BASE >> 14) + k: (self.flash, (k << 14) - (FLASH_BASE & 0x3FFF)) for k in range(FLASH_SIZE >> 14)}
+		self.banks.update({base >> 14: (mem, 0) for (base, _), mem in zip(SRAM, self.sram)})
+		self.latch = bytearray(b"\xff" * PAGE)
+		self.gpnvm = 0
+		self.fmr = 0
+		self.frr = 0
+		self.fsr = FSR_FRDY
+		self.busy_until = 0
+
+	def log(self, msg):
+		if self.verbose:
+			print("board %d: %s" % (self.index, msg))
+
+	def save(self):
+		if self.path:
+			open(self.path, "wb").write(self.flash)
+
+	# memory, as seen by the host's commands and the applet alike
+
+	def region(self, addr, size):
+		if FLASH_BASE <= addr and addr + size <= FLASH_BASE + FLASH_SIZE:
+			return self.flash, addr - FLASH_BASE
+		for (base, length), mem in zip(SRAM, self.sram):
+			if base <= addr and addr + size <= base + length:
+				return mem, addr - base
+		return None, 0
+
+	def read(self, addr, size):
+		bank = self.banks.get(addr >> 14)
+		if bank is not None and (addr & 0x3FFF) + size <= 0x4000:
+			off = bank[1] + (addr & 0x3FFF)
+			return int.from_bytes(bank[0][off:off+size], "little")
+		if size == 4 and addr == EEFC0:
+			return self.fmr
+		if size == 4 and addr == EEFC0 + 8:
+			if self.busy_until and time.monotonic() < self.busy_until:
+				return self.fsr & ~FSR_FRDY
+			self.busy_until = 0
+			return self.fsr
+		if size == 4 and addr == EEFC0 + 12:
+			return self.frr
+		raise Fault("read%d of %08x" % (size*8, addr))
+
+	def write(self, addr, size, value):
+		if FLASH_BASE <= addr < FLASH_BASE + FLASH_SIZE:
+			# flash addresses fill the latch; EEFC commands write it
+			if size != 4:
+				raise Fault("write%d to flash at %08x" % (size*8, addr))
+			off = addr % PAGE
+			self.latch[off:off+4] = value.to_bytes(4, "little")
+			return
+		mem, off = self.region(addr, size)
+		if mem is not None:
+			mem[off:off+size] = (value & ((1 << size*8) - 1)).to_bytes(size, "little")
+		elif size == 4 and addr == EEFC0:
+			self.fmr = value
+		elif size == 4 and addr == EEFC0 + 4:
+			self.flash_command(value)
+		elif size == 4 and addr == RSTC_CR:
+			if (value >> 24) == 0xA5 and (value & 1):
+				raise Reset()
+		else:
+			raise Fault("write%d of %08x to %08x" % (size*8, value, addr))
+
+	def flash_command(self, fcr):
+		key, arg, cmd = fcr >> 24, (fcr >> 8) & 0xFFFF, fcr & 0xFF
+		if self.busy_until and time.monotonic() < self.busy_until:
+			raise Fault("EEFC command %02x while busy" % cmd)
+		self.fsr = FSR_FRDY
+		if key != 0x5A:
+			self.fsr |= FSR_FCMDE
+		elif cmd in (0x01, 0x03):          # WP, EWP
+			if arg >= FLASH_SIZE // PAGE:
+				self.fsr |= FSR_FCMDE
+			else:
+				start = arg * PAGE
+				if cmd == 0x01:
+					for i in range(PAGE):
+						self.flash[start+i] &= self.latch[i]
+				else:
+					self.flash[start:start+PAGE] = self.latch
+				self.busy_until = time.monotonic() + self.page_ms / 1000.0
+		elif cmd == 0x05:                   # EA
+			self.flash[:] = b"\xff" * FLASH_SIZE
+			self.busy_until = time.monotonic() + 0.01
+		elif cmd in (0x0B, 0x0C):           # SGPB, CGPB
+			if arg > 2:
+				self.fsr |= FSR_FCMDE
+			elif cmd == 0x0B:
+				self.gpnvm |= 1 << arg
+			else:
+				self.gpnvm &= ~(1 << arg)
+		elif cmd == 0x0D:                   # GGPB
+			self.frr = self.gpnvm
+		else:
+			self.fsr |= FSR_FCMDE
+		self.latch[:] = b"\xff" * PAGE
+
+	# the 16-bit Thumb instructions, enough for an applet
+
+	def run(self, entry):
+		r = [0] * 16
+		r[13], r[14], r[15] = MONITOR_SP, MONITOR_RETURN | 1, entry & ~1
+		flags = [0, 0, 0, 0]                # N Z C V
+		mask = 0xFFFFFFFF
+		code = {}                           # the applet doesn't rewrite itself
+
+		def nz(v):
+			v &= mask
+			flags[0], flags[1] = v >> 31, int(v == 0)
+			return v
+
+		def add(a, b, c=0):
+			s = a + b + c
+			v = nz(s)
+			flags[2] = int(s > mask)
+			flags[3] = int(((a ^ v) & (b ^ v)) >> 31 & 1)
+			return v
+
+		def sub(a, b):
+			return add(a, (~b) & mask, 1)
+
+		def cond(c):
+			n, z, cf, v = flags
+			return [z, not z, cf, not cf, n, not n, v, not v, cf and not z, not cf or z,
+			        n == v, n != v, not z and n == v, z or n != v, True][c]
+
+		for _ in range(STEP_LIMIT):
+			pc = r[15]
+			if pc == MONITOR_RETURN:
+				return
+			op = code.get(pc)
+			if op is None:
+				op = code[pc] = self.read(pc, 2)
+			nxt = pc + 2
+			top = op >> 11
+			if top < 3:                     # LSL, LSR, ASR immediate
+				rd, rm, imm = op & 7, (op >> 3) & 7, (op >> 6) & 31
+				v = r[rm]
+				if top == 0:
+					if imm:
+						flags[2] = (v >> (32 - imm)) & 1
+					v <<= imm
+				else:
+					imm = imm or 32
+					flags[2] = (v >> (imm - 1)) & 1
+					if top == 2 and v >> 31:
+						v |= ~mask
+					v >>= imm
+				r[rd] = nz(v)
+			elif top == 3:                  # ADD, SUB register or imm3
+				rd, rn, x = op & 7, (op >> 3) & 7, (op >> 6) & 7
+				b = x if op & 0x400 else r[x]
+				r[rd] = sub(r[rn], b) if op & 0x200 else add(r[rn], b)
+			elif top < 8:                   # MOV, CMP, ADD, SUB imm8
+				rd, imm = (op >> 8) & 7, op & 0xFF
+				if top == 4:
+					r[rd] = nz(imm)
+				elif top == 5:
+					sub(r[rd], imm)
+				elif top == 6:
+					r[rd] = add(r[rd], imm)
+				else:
+					r[rd] = sub(r[rd], imm)
+			elif (op >> 10) == 0x10:        # data processing
+				rd, rm, alu = op & 7, (op >> 3) & 7, (op >> 6) & 15
+				a, b = r[rd], r[rm]
+				if alu == 0:
+					r[rd] = nz(a & b)
+				elif alu == 1:
+					r[rd] = nz(a ^ b)
+				elif alu in (2, 3, 7):
+					s = b & 0xFF
+					if s == 0:
+						v = a
+					elif alu == 2:
+						flags[2] = (a >> (32 - s)) & 1 if s <= 32 else 0
+						v = a << s
+					elif alu == 3:
+						flags[2] = (a >> (s - 1)) & 1 if s <= 32 else 0
+						v = a >> s
+					else:
+						s %= 32
+						v = ((a >> s) | (a << (32 - s))) & mask
+						flags[2] = v >> 31
+					r[rd] = nz(v)
+				elif alu == 5:
+					r[rd] = add(a, b, flags[2])
+				elif alu == 6:
+					r[rd] = add(a, (~b) & mask, flags[2])
+				elif alu == 8:
+					nz(a & b)
+				elif alu == 9:
+					r[rd] = sub(0, b)
+				elif alu == 10:
+					sub(a, b)
+				elif alu == 11:
+					add(a, b)
+				elif alu == 12:
+					r[rd] = nz(a | b)
+				elif alu == 13:
+					r[rd] = nz(a * b)
+				elif alu == 14:
+					r[rd] = nz(a & ~b)
+				elif alu == 15:
+					r[rd] = nz(~b)
+				else:
+					raise Fault("ASR by register at %08x" % pc)
+			elif (op >> 10) == 0x11:        # ADD, CMP, MOV high registers, BX
+				rd, rm, o = (op & 7) | ((op >> 4) & 8), (op >> 3) & 15, (op >> 8) & 3
+				b = (pc + 4) if rm == 15 else r[rm]
+				if o == 0:
+					r[rd] = (r[rd] + b) & mask
+					if rd == 15:
+						nxt = r[15] & ~1
+				elif o == 1:
+					sub(r[rd], b)
+				elif o == 2:
+					r[rd] = b
+					if rd == 15:
+						nxt = b & ~1
+				else:
+					nxt = b & ~1
+			elif top == 9:                  # LDR literal
+				r[(op >> 8) & 7] = self.read(((pc + 4) & ~3) + (op & 0xFF) * 4, 4)
+			elif (op >> 12) == 5:           # load/store register offset
+				rd, addr = op & 7, r[(op >> 3) & 7] + r[(op >> 6) & 7]
+				kind = (op >> 9) & 7
+				if kind == 0:
+					self.write(addr, 4, r[rd])
+				elif kind == 1:
+					self.write(addr, 2, r[rd])
+				elif kind == 2:
+					self.write(addr, 1, r[rd])
+				elif kind == 4:
+					r[rd] = self.read(addr, 4)
+				elif kind == 5:
+					r[rd] = self.read(addr, 2)
+				elif kind == 6:
+					r[rd] = self.read(addr, 1)
+				else:
+					v = self.read(addr, 1 if kind == 3 else 2)
+					bits = 8 if kind == 3 else 16
+					r[rd] = (v - (1 << bits)) & mask if v >> (bits - 1) else v
+			elif (op >> 13) == 3 or (op >> 12) == 8:   # load/store immediate offset
+				rd, rn, imm = op & 7, (op >> 3) & 7, (op >> 6) & 31
+				size = 2 if (op >> 12) == 8 else (1 if op & 0x1000 else 4)
+				addr = r[rn] + imm * size
+				if op & 0x800:
+					r[rd] = self.read(addr, size)
+				else:
+					self.write(addr, size, r[rd])
+			elif (op >> 12) == 9:           # load/store SP-relative
+				rd, addr = (op >> 8) & 7, r[13] + (op & 0xFF) * 4
+				if op & 0x800:
+					r[rd] = self.read(addr, 4)
+				else:
+					self.write(addr, 4, r[rd])
+			elif (op >> 12) == 10:          # ADR, ADD Rd, SP, #imm
+				base = r[13] if op & 0x800 else (pc + 4) & ~3
+				r[(op >> 8) & 7] = base + (op & 0xFF) * 4
+			elif (op >> 8) == 0xB0:         # ADD, SUB SP, #imm
+				imm = (op & 0x7F) * 4
+				r[13] = (r[13] - imm if op & 0x80 else r[13] + imm) & mask
+			elif (op & 0xF600) == 0xB400:   # PUSH, POP
+				regs = [i for i in range(8) if op & (1 << i)]
+				if op & 0x800:
+					if op & 0x100:
+						regs.append(15)
+					for i in regs:
+						r[i] = self.read(r[13], 4)
+						r[13] += 4
+					if op & 0x100:
+						nxt = r[15] & ~1
+				else:
+					if op & 0x100:
+						regs.append(14)
+					r[13] -= 4 * len(regs)
+					for k, i in enumerate(regs):
+						self.write(r[13] + 4 * k, 4, r[i])
+			elif (op >> 12) == 12:          # LDM, STM
+				rn = (op >> 8) & 7
+				addr = r[rn]
+				for i in range(8):
+					if op & (1 << i):
+						if op & 0x800:
+							r[i] = self.read(addr, 4)
+						else:
+							self.write(addr, 4, r[i])
+						addr += 4
+				if not (op & 0x800 and op & (1 << rn)):
+					r[rn] = addr
+			elif (op >> 12) == 13 and ((op >> 8) & 15) < 14:    # B<cond>
+				if cond((op >> 8) & 15):
+					off = op & 0xFF
+					nxt = pc + 4 + ((off - 256 if off & 0x80 else off) << 1)
+			elif top == 28:                 # B
+				off = op & 0x7FF
+				nxt = pc + 4 + ((off - 2048 if off & 0x400 else off) << 1)
+			else:
+				raise Fault("unsupported instruction %04x at %08x" % (op, pc))
+			r[15] = nxt & mask
+		raise Fault("applet at %08x still running after %d instructions" % (entry, STEP_LIMIT))
+
+	# the monitor
+
+	def serve(self, conn):
+		buf = bytearray()
+		binary = False
+
+		def reply(data):
+			conn.sendall(bytes(data))
+
+		def need(n):
+			while len(buf) < n:
+				chunk = conn.recv(65536)
+				if not chunk:
+					raise EOFError()
+				buf.extend(chunk)
+
+		while True:
+			while b"#" not in buf:
+				need(len(buf) + 1)
+			end = buf.index(b"#")
+			line = buf[:end].decode("ascii", "replace").strip()
+			del buf[:end+1]
+			if not line:
+				continue
+			cmd, args = line[0], [int(a, 16) for a in line[1:].split(",") if a]
+			if cmd == "N":
+				binary = True
+				reply(b"\n\r")
+			elif cmd == "T":
+				binary = False
+				reply(b"\n\r>")
+			elif cmd == "V":
+				reply(b"v1.1 Nov 18 2010 (sam-ba-sim)\n\r")
+			elif cmd in "WHO":
+				size = {"W": 4, "H": 2, "O": 1}[cmd]
+				self.write(args[0], size, args[1])
+			elif cmd in "who":
+				size = {"w": 4, "h": 2, "o": 1}[cmd]
+				v = self.read(args[0], size)
+				reply(v.to_bytes(size, "little") if binary else ("\n\r0x%0*X\n\r>" % (size*2, v)).encode())
+			elif cmd == "S":
+				addr, length = args
+				need(length)
+				mem, off = self.region(addr, length)
+				if mem is None or mem is self.flash:
+					raise Fault("S of %d bytes to %08x" % (length, addr))
+				mem[off:off+length] = buf[:length]
+				del buf[:length]
+			elif cmd == "R":
+				addr, length = args
+				mem, off = self.region(addr, length)
+				if mem is None:
+					raise Fault("R of %d bytes from %08x" % (length, addr))
+				reply(mem[off:off+length])
+			elif cmd == "G":
+				start = time.monotonic()
+				self.run(args[0])
+				self.log("G %08x returned after %.0fms" % (args[0], (time.monotonic() - start) * 1000))
+			else:
+				raise Fault("unknown command %r" % line)
+			if not binary and cmd not in "NTVwho":
+				reply(b"\n\r>")
+
+	def listen(self, path):
+		if os.path.exists(path):
+			os.unlink(path)
+		server = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+		server.bind(path)
+		server.listen(1)
+		while True:
+			conn, _ = server.accept()
+			try:
+				self.serve(conn)
+			except EOFError:
+				pass
+			except Reset:
+				self.save()
+				print("board %d: reset, booting from %s" % (self.index, "flash" if self.gpnvm & 2 else "ROM"))
+			except Fault as e:
+				print("board %d: fault: %s" % (self.index, e))
+			conn.close()
+			self.save()
+
+def main():
+	opts, args = getopt.getopt(sys.argv[1:], "n:p:f:v")
+	opts = dict(opts)
+	if len(args) != 1:
+		sys.exit("usage: sam-ba-sim.py [-n boards] [-p ms] [-f prefix] [-v] socket")
+	boards = int(opts.get("-n", 1))
+	procs = []
+	for i in range(boards):
+		path = "%s.%d.bin" % (opts["-f"], i) if "-f" in opts else None
+		board = Board(i, float(opts.get("-p", 4)), path, "-v" in opts)
+		p = multiprocessing.Process(target=board.listen, args=("%s.%d" % (args[0], i),), daemon=True)
+		p.start()
+		procs.append(p)
+	signal.signal(signal.SIGTERM, lambda *_: sys.exit(0))
+	print("sam-ba-sim: %d board(s) on %s.0-%d" % (boards, args[0], boards - 1))
+	sys.stdout.flush()
+	try:
+		for p in procs:
+			p.join()
+	except KeyboardInterrupt:
+		pass
+
+if __name__ == "__main__":
+	main()
@@ -1,89 +1,206 @@
+#!/usr/bin/env python
 # Copyright 2014 Ian Daniher, Analog Devices
 # Licensed under GPLv3
 # This is fully functional sam-ba client capable of loading a binary executable onto the internal flash of a sam3u processor.
 # This code is not impacted by any of the bugs in the ROM
-
-import bitstring
-import glob
-import time
-import usb
-
-print "please wait..."
-
-raw = open("./m1000.bin").read()
-raw += '\x00'*(256-len(raw)%256)
-
-fw = bitstring.ConstBitStream(bytes=raw)
-
-dev = usb.core.find(idVendor=0x03eb,idProduct=0x6124)
-
-try:
-	dev.detach_kernel_driver(0)
-	dev.detach_kernel_driver(1)
-except:
-	pass
-
-dev.set_configuration(1)
-regBase = 0x400e0800
-flashBase = 0x80000
-offset = 0
-
-def getStr():
-	return ''.join(map(chr, dev.read(0x82, 512, 1)))
-
-def putStr(x):
-	return dev.write(0x01, x, 1)
-
-# erase flash
-putStr("W400E0804,5A000005#")
-time.sleep(0.1)
-getStr()
-# check if flash is erased
-putStr("w400E0808,4#")
-time.sleep(0.01)
-getStr()
-getStr()
-getStr()
-
-page = 0
-
-# write each word
-for pos in xrange(0,fw.length/8,4):
-	fw.bytepos = pos
-	addr = hex(flashBase+pos).lstrip("0x").rstrip("L").zfill(8)
-	data = hex(fw.peek("<L")).lstrip("0x").rstrip("L").zfill(8)
-	cmd = ("W"+addr+","+data+"#").upper()
+#
+#   sam-ba.py [-b] [-n boards] [image.bin]
+#
+# Flashes every SAM3U in the SAM-BA ROM at once (m1000.bin by default).
+# The monitor is driven in binary mode: the image goes to SRAM with large
+# S transfers, and a small applet (samba_applet.S) writes it through the
+# EEFC, waiting on FRDY itself, and then returns the CRC-32 of the flash
+# in place of a readback. Only the image's pages are written, so the
+# calibration pages keep their contents. -n waits for that many boards to
+# appear, -b prints how long each step took.
+#
+# With SAMBA_SIM_SOCKET set, the boards are those of sam-ba-sim.py.
+from __future__ import print_function
+import getopt, glob, os, socket, struct, sys, threading, time, zlib
+
+SAMBA_IDS = (0x03eb, 0x6124)
+EEFC0_FMR, EEFC0_FCR, EEFC0_FSR = 0x400E0800, 0x400E0804, 0x400E0808
+RSTC_CR = 0x400E1200
+FLASH_BASE, PAGE = 0x80000, 256
+IMAGE_MAX = (0x20000 - 512) // 2        # as scripts/flash.ld
+
+# samba_applet.S, from `make -C scripts applet`
+APPLET = bytearray.fromhex(
+	"00e021e0f0b530a738687968ba680024002a16d01a4b0d02082424042d194026"
+	"10c810c5761efbd10c02164e34435c609c686608fcd30626344002d1491c521e"
+	"edd1fc607960f0bdf0b51fa7386979690da60022d24300290ed00478401c6240"
+	"1407a40e3459120962401407a40e345912096240491ef0d1d243ba61f0bd0000"
+	"00080e400300005a000000006410b71dc8206e3bac30d9269041dc76f4516b6b"
+	"5861b24d3c7105502083b8ed44930ff0e8a3d6d68cb361cbb0c2649bd4d2d386"
+	"78e20aa01cf2bdbd000000000000000000000000000000000000000000000000"
+	"00000000"
+)
+APPLET_ADDR = 0x20001000
+WRITE_PAGES = APPLET_ADDR + 0 + 1       # Thumb
+CRC32 = APPLET_ADDR + 2 + 1
+PARAMS = APPLET_ADDR + len(APPLET) - 28
+# SRAM1, clear of the monitor's own data and stack in SRAM0
+BUFFER_ADDR, BUFFER_PAGES = 0x20080000, 64
+
+class UsbPort:
+	def __init__(self, dev):
+		import usb
+		self.usb, self.dev = usb, dev
+		self.name = "usb %d.%d" % (dev.bus, dev.address)
+		for i in (0, 1):
+			try:
+				dev.detach_kernel_driver(i)
+			except Exception:
+				pass
+		dev.set_configuration(1)
+		# drop whatever the monitor printed before we took over
+		try:
+			while dev.read(0x82, 512, 10):
+				pass
+		except usb.core.USBError:
+			pass
+
+	def write(self, data):
+		self.dev.write(0x01, data, 5000)
+
+	def read(self, n):
+		return bytearray(self.dev.read(0x82, n, 5000))
+
+class SocketPort:
+	def __init__(self, path):
+		self.name = path
+		self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+		self.sock.connect(path)
+
+	def write(self, data):
+		self.sock.sendall(bytes(data))
+
+	def read(self, n):
+		data = bytearray()
+		while len(data) < n:
+			chunk = self.sock.recv(n - len(data))
+			if not chunk:
+				raise IOError("connection closed")
+			data.extend(chunk)
+		return data
+
+class Samba:
+	"""The monitor's binary mode. Commands go in a transfer of their own, as
+	the ROM loses one split across USB packets; none reply but w and N."""
+	def __init__(self, port):
+		self.port = port
+		self.command("N#")
+		self.port.read(2)
+
+	def command(self, cmd):
+		self.port.write(bytearray(cmd.encode("ascii")))
+
+	def write_word(self, addr, value):
+		self.command("W%08X,%08X#" % (addr, value))
+
+	def read_word(self, addr):
+		self.command("w%08X,4#" % addr)
+		return struct.unpack("<I", bytes(self.port.read(4)))[0]
+
+	def send(self, addr, data):
+		self.command("S%08X,%08X#" % (addr, len(data)))
+		self.port.write(data)
+
+	def go(self, addr):
+		"""the monitor reads nothing more until the code returns, so the
+		next w also waits for it"""
+		self.command("G%08X#" % addr)
+
+def flash(port, image, times):
+	samba = Samba(port)
+	times.append(("connect", time.time()))
+	# six wait states while programming, as for all SAM3 (errata)
+	samba.write_word(EEFC0_FMR, 6 << 8)
+	samba.send(APPLET_ADDR, APPLET)
+	samba.write_word(PARAMS + 0, BUFFER_ADDR)
+	times.append(("applet", time.time()))
+
+	pages = len(image) // PAGE
+	for first in range(0, pages, BUFFER_PAGES):
+		count = min(BUFFER_PAGES, pages - first)
+		samba.send(BUFFER_ADDR, image[first*PAGE:(first+count)*PAGE])
+		samba.write_word(PARAMS + 4, first)
+		samba.write_word(PARAMS + 8, count)
+		samba.go(WRITE_PAGES)
+		error = samba.read_word(PARAMS + 12)
+		if error:
+			raise IOError("EEFC status %#x writing page %d" % (error, samba.read_word(PARAMS + 4)))
+	times.append(("write", time.time()))
+
+	samba.write_word(PARAMS + 16, FLASH_BASE)
+	samba.write_word(PARAMS + 20, len(image))
+	samba.go(CRC32)
+	crc, expected = samba.read_word(PARAMS + 24), zlib.crc32(bytes(image)) & 0xFFFFFFFF
+	if crc != expected:
+		raise IOError("flash CRC %08x, image %08x" % (crc, expected))
+	times.append(("verify", time.time()))
+
+	# boot from flash (GPNVM bit 1), then reset into it
+	samba.write_word(EEFC0_FCR, 0x5A00010B)
+	for _ in range(1000):
+		fsr = samba.read_word(EEFC0_FSR)
+		if fsr & 1:
+			break
+	if fsr != 1:
+		raise IOError("EEFC status %#x setting GPNVM1" % fsr)
+	samba.write_word(RSTC_CR, 0xA500000D)
+	times.append(("boot", time.time()))
+
+def find_ports(wanted):
+	path = os.environ.get("SAMBA_SIM_SOCKET")
+	deadline = time.time() + 10
+	while True:
+		if path:
+			found = sorted(glob.glob(path + ".*"))
+		else:
+			import usb.core
+			found = list(usb.core.find(find_all=True, idVendor=SAMBA_IDS[0], idProduct=SAMBA_IDS[1]))
+		# boards sent to the ROM by 0xBB take a moment to come back
+		if len(found) >= wanted or time.time() > deadline:
+			return [SocketPort(p) if path else UsbPort(p) for p in found]
+		time.sleep(0.1)
+
+def run(port, image, results):
+	times = [("start", time.time())]
 	try:
-		putStr(cmd)
-		getStr()
-		getStr()
-	except:
-		print 'error at', cmd
-		quit()
-	# if at end of page
-	if pos & 0xFC == 0xFC:
-		# write page
-		cmd = "W400E0804,5A00"+hex(page).lstrip("0x").zfill(2)+"03#"
-		putStr(cmd)
-		time.sleep(0.01)
-		getStr()
-		getStr()
-		# check that page is written
-		putStr("w400E0808,4#")
-		time.sleep(0.01)
-		getStr()
-		getStr()
-		assert int(getStr().strip(), 16) == 1
-		page += 1
-
-
-# disable SAM-BA
-putStr("W400E0804,5A00010B#")
-getStr()
-getStr()
-
-# jump to flash
-putStr("G00000000#")
-getStr()
-
-print "good to go!"
+		flash(port, image, times)
+		results[port.name] = (None, times)
+	except Exception as e:
+		results[port.name] = (e, times)
+
+opts, args = getopt.getopt(sys.argv[1:], "bn:")
+opts = dict(opts)
+image = bytearray(open(args[0] if args else "./m1000.bin", "rb").read())
+if len(image) > IMAGE_MAX:
+	sys.exit("image is %d bytes, the firmware area %d" % (len(image), IMAGE_MAX))
+image += b"\xff" * (-len(image) % PAGE)
+
+print("please wait...")
+ports = find_ports(int(opts.get("-n", 1)))
+if not ports:
+	sys.exit("no SAM-BA device found")
+start = time.time()
+results = {}
+threads = [threading.Thread(target=run, args=(port, image, results)) for port in ports]
+for t in threads:
+	t.start()
+for t in threads:
+	t.join()
+
+for name in sorted(results):
+	error, times = results[name]
+	if error:
+		print("%s: failed after %s: %s" % (name, times[-1][0], error))
+	else:
+		print("%s: good to go!" % name)
+	if "-b" in opts:
+		steps = ", ".join("%s %.0fms" % (step, (t - times[i][1]) * 1000) for i, (step, t) in enumerate(times[1:]))
+		print("    %s; %.1fKB/s" % (steps, len(image) / 1024.0 / (times[-1][1] - times[0][1])))
+if "-b" in opts:
+	print("%d board(s), %d bytes, in %.2fs" % (len(ports), len(image), time.time() - start))
+sys.exit(0 if all(e is None for e, _ in results.values()) else 1)
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <stddef.h>
+#include <stdint.h>
+
+/// Bounded single-producer/single-consumer queue.
+/// push() is only ever called from one thread and pop() from one other;
+/// neither locks, and a full or empty ring is reported rather than waited on.
+/// Head and tail are free-running counters, so size() is exact for the
+/// consumer and an upper bound for the producer.
+template<typename T>
+struct SpscRing {
+	SpscRing(size_t capacity): m_slots(pow2(capacity)), m_mask(m_slots.size() - 1) {}
+
+	bool push(const T& v) {
+		uint64_t head = m_head.load(std::memory_order_relaxed);
+		if (head - m_tail.load(std::memory_order_acquire) == m_slots.size()) return false;
+		m_slots[head & m_mask] = v;
+		m_head.store(head + 1, std::memory_order_release);
+		uint64_t used = head + 1 - m_tail.load(std::memory_order_relaxed);
+		if (used > m_high_water.load(std::memory_order_relaxed)) m_high_water.store(used, std::memory_order_relaxed);
+		return true;
+	}
+
+	bool pop(T& v) {
+		uint64_t tail = m_tail.load(std::memory_order_relaxed);
+		if (tail == m_head.load(std::memory_order_acquire)) return false;
+		v = m_slots[tail & m_mask];
+		m_tail.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	/// pop, backing off from spinning to short sleeps while the ring stays
+	/// empty; gives up once `stop` is set
+	bool pop_wait(T& v, const std::atomic<bool>& stop) {
+		for (unsigned spins = 0; !stop.load(std::memory_order_relaxed); spins++) {
+			if (pop(v)) return true;
+			if (spins < 64) std::this_thread::yield();
+			else std::this_thread::sleep_for(std::chrono::microseconds(50));
+		}
+		return false;
+	}
+
+	size_t size() const {
+		return m_head.load(std::memory_order_acquire) - m_tail.load(std::memory_order_acquire);
+	}
+
+	size_t capacity() const { return m_slots.size(); }
+
+	/// most entries ever queued at once
+	size_t high_water() const { return m_high_water.load(std::memory_order_relaxed); }
+
+private:
+	static size_t pow2(size_t n) {
+		size_t p = 1;
+		while (p < n) p <<= 1;
+		return p;
+	}
+
+	std::vector<T> m_slots;
+	const size_t m_mask;
+	// padded onto separate cache lines so the two threads don't contend
+	std::atomic<uint64_t> m_head{0};
+	char m_pad[64 - sizeof(std::atomic<uint64_t>)];
+	std::atomic<uint64_t> m_tail{0};
+	std::atomic<uint64_t> m_high_water{0};
+};
@@ -0,0 +1,270 @@
+#include "stream_device.h"
+#include "unpack.h"
+
+#include <algorithm>
+#include <iostream>
+#include <string.h>
+#include <endian.h>
+#include <sys/time.h>
+
+/// matches bulk_header_t in the firmware, enabled with request 0xDE
+struct PacketHeader {
+	uint32_t seq;
+	uint16_t frame;
+	uint16_t flags;
+};
+
+const uint16_t HDR_UNDERRUN = 1<<1;
+
+/// CAL_MAGIC in the firmware
+const uint32_t CAL_MAGIC = 0x314C4143;
+
+/// CMD_LIST_MAX in the firmware
+const size_t COMMAND_LIST_MAX = 32;
+
+/// Runs in USB thread
+extern "C" void LIBUSB_CALL stream_in_completion(libusb_transfer *t) {
+	((StreamDevice*) t->user_data)->in_completed(t);
+}
+
+/// Runs in USB thread
+extern "C" void LIBUSB_CALL stream_out_completion(libusb_transfer *t) {
+	((StreamDevice*) t->user_data)->out_completed(t);
+}
+
+StreamDevice::~StreamDevice() {
+	stop();
+}
+
+void StreamDevice::claim() {
+	libusb_claim_interface(m_usb, 0);
+	libusb_set_interface_alt_setting(m_usb, 0, 1);
+}
+
+void StreamDevice::release() {
+	libusb_release_interface(m_usb, 0);
+}
+
+int StreamDevice::commands(const std::vector<Command>& cmds) {
+	for (size_t first = 0; first < cmds.size(); first += COMMAND_LIST_MAX) {
+		size_t n = std::min(cmds.size() - first, COMMAND_LIST_MAX);
+		std::vector<uint8_t> list;
+		for (size_t i = first; i < first + n; i++) {
+			const Command& c = cmds[i];
+			uint8_t entry[5] = {c.request, (uint8_t) c.value, (uint8_t) (c.value >> 8),
+			                    (uint8_t) c.index, (uint8_t) (c.index >> 8)};
+			list.insert(list.end(), entry, entry + sizeof(entry));
+		}
+
+		if (libusb_control_transfer(m_usb, 0x40, 0x78, 0, 0, &list[0], list.size(), 100) != (int) list.size()) {
+			// firmware without command lists stalls 0x78
+			for (size_t i = first; i < cmds.size(); i++) {
+				const Command& c = cmds[i];
+				if (libusb_control_transfer(m_usb, 0x40, c.request, c.value, c.index, NULL, 0, 100) < 0) return i;
+			}
+			return -1;
+		}
+
+		uint8_t status[COMMAND_LIST_MAX];
+		int r = libusb_control_transfer(m_usb, 0x40|0x80, 0x79, 0, 0, status, sizeof(status), 100);
+		if (r != (int) n) return first;
+		for (size_t i = 0; i < n; i++) {
+			if (status[i] != 0) return first + i;
+		}
+	}
+	return -1;
+}
+
+bool StreamDevice::calibration(Calibration& out) {
+	// cal_table_t: magic, sequence, 8 x {offset, gain_pos, gain_neg}, crc
+	uint32_t table[2 + 8*3 + 1];
+	int r = libusb_control_transfer(m_usb, 0x40|0x80, 0x7E, 0, 0, (uint8_t*) table, sizeof(table), 100);
+	if (r != (int) sizeof(table) || le32toh(table[0]) != CAL_MAGIC) return false;
+	out.sequence = le32toh(table[1]);
+	for (unsigned i = 0; i < 8; i++) {
+		out.path[i].offset = le32toh(table[2 + i*3]);
+		out.path[i].gain_pos = le32toh(table[3 + i*3]);
+		out.path[i].gain_neg = le32toh(table[4 + i*3]);
+	}
+	return true;
+}
+
+bool StreamDevice::start(const StreamConfig& config, OutSource source, InSink sink) {
+	stop();
+	m_config = config;
+	m_source = source;
+	m_sink = sink;
+
+	uint8_t buf[4];
+	// stop any previous stream so the packet geometry can change
+	int failed = commands({{0xC5, 0, 0}, {0xC6, (uint16_t) config.chunk, 0}, {0xDE, 1, 0}});
+	if (failed == 0) {
+		std::cerr << "could not stop the previous stream" << std::endl;
+		return false;
+	}
+	if (failed == 1) {
+		std::cerr << "chunk size " << config.chunk << " rejected" << std::endl;
+		return false;
+	}
+	if (failed == 2) {
+		std::cerr << "packet header not supported" << std::endl;
+		return false;
+	}
+
+	const size_t hdr = sizeof(PacketHeader);
+	m_in_transfers.clear();
+	m_out_transfers.clear();
+	m_in_transfers.alloc(config.in_transfers, m_usb, 0x81, LIBUSB_TRANSFER_TYPE_BULK,
+	                     hdr + config.chunk*8, 1000, stream_in_completion, this);
+	m_out_transfers.alloc(config.out_transfers, m_usb, 0x02, LIBUSB_TRANSFER_TYPE_BULK,
+	                      config.chunk*4, 1000, stream_out_completion, this);
+	m_in_ready.reset(new SpscRing<libusb_transfer*>(config.in_transfers));
+	m_out_free.reset(new SpscRing<libusb_transfer*>(config.out_transfers));
+	m_planes.resize(config.chunk*4);
+	m_out_a.resize(config.chunk);
+	m_out_b.resize(config.chunk);
+
+	m_in_sampleno = m_out_sampleno = 0;
+	m_next_seq = 0;
+	m_in_samples = m_out_samples = 0;
+	m_lost_chunks = m_stale_chunks = m_underrun_chunks = m_transfer_errors = 0;
+	m_stopping = m_finished = m_events_done = false;
+
+	libusb_control_transfer(m_usb, 0x40|0x80, 0xC5, config.period, 0, buf, 1, 100);
+
+	// Every OUT transfer starts out free for the producer to fill
+	for (auto t: m_out_transfers) m_out_free->push(t);
+	for (auto t: m_in_transfers) submit(t);
+
+	m_usb_thread = std::thread([this]() {
+		timeval tv = {0, 100000};
+		while (!m_events_done) libusb_handle_events_timeout_completed(NULL, &tv, NULL);
+	});
+	m_consumer = std::thread(&StreamDevice::consume, this);
+	m_producer = std::thread(&StreamDevice::produce, this);
+	m_running = true;
+	return true;
+}
+
+void StreamDevice::wait() {
+	while (m_running && !m_finished) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+}
+
+void StreamDevice::stop() {
+	if (!m_running) return;
+	m_running = false;
+
+	// Workers first, so nothing is resubmitted behind the cancellations
+	m_stopping = true;
+	m_consumer.join();
+	m_producer.join();
+
+	uint8_t buf[4];
+	libusb_control_transfer(m_usb, 0x40|0x80, 0xC5, 0, 0, buf, 1, 100);
+	for (auto t: m_in_transfers) libusb_cancel_transfer(t);
+	for (auto t: m_out_transfers) libusb_cancel_transfer(t);
+	while (m_in_flight > 0) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	m_events_done = true;
+	m_usb_thread.join();
+}
+
+StreamCounters StreamDevice::counters() const {
+	StreamCounters c;
+	c.in_samples = m_in_samples;
+	c.out_samples = m_out_samples;
+	c.lost_chunks = m_lost_chunks;
+	c.stale_chunks = m_stale_chunks;
+	c.underrun_chunks = m_underrun_chunks;
+	c.transfer_errors = m_transfer_errors;
+	c.in_ring_high_water = m_in_ready ? m_in_ready->high_water() : 0;
+	c.out_ring_high_water = m_out_free ? m_out_free->high_water() : 0;
+	return c;
+}
+
+void StreamDevice::submit(libusb_transfer* t) {
+	m_in_flight++;
+	if (libusb_submit_transfer(t) != 0) {
+		m_in_flight--;
+		m_transfer_errors++;
+	}
+}
+
+void StreamDevice::in_completed(libusb_transfer* t) {
+	// The ring holds every IN transfer, so this can't fail
+	m_in_ready->push(t);
+	m_in_flight--;
+}
+
+void StreamDevice::out_completed(libusb_transfer* t) {
+	m_out_free->push(t);
+	m_in_flight--;
+}
+
+void StreamDevice::consume() {
+	const size_t n = m_config.chunk;
+	const unpack_fn unpack = unpack_best().planar;
+	libusb_transfer* t;
+
+	while (m_in_ready->pop_wait(t, m_stopping)) {
+		if (t->status != LIBUSB_TRANSFER_COMPLETED || t->actual_length != t->length) {
+			if (t->status != LIBUSB_TRANSFER_CANCELLED) m_transfer_errors++;
+			if (!m_finished) submit(t);
+			continue;
+		}
+
+		PacketHeader hdr;
+		memcpy(&hdr, t->buffer, sizeof(hdr));
+		hdr.seq = le32toh(hdr.seq);
+		hdr.flags = le16toh(hdr.flags);
+		// The device numbers every chunk it captures, sent or not. One
+		// numbered before the next expected has been delivered or counted
+		// lost already, so it is dropped rather than delivered out of order.
+		int32_t gap = (int32_t)(hdr.seq - (uint32_t)m_next_seq);
+		if (gap < 0) {
+			m_stale_chunks++;
+			if (!m_finished) submit(t);
+			continue;
+		}
+		// extended past the device's 32 bits, and numbering the samples, so
+		// lost chunks leave a hole in sampleno rather than shifting the rest
+		const uint64_t seq = m_next_seq + gap;
+		m_lost_chunks += gap;
+		m_next_seq = seq + 1;
+		if (hdr.flags & HDR_UNDERRUN) m_underrun_chunks++;
+
+		uint16_t* const planes[4] = {&m_planes[0], &m_planes[n], &m_planes[n*2], &m_planes[n*3]};
+		unpack(t->buffer + sizeof(hdr), n, planes);
+		Samples s = {seq * n, n, &m_planes[0], &m_planes[n], &m_planes[n*2], &m_planes[n*3]};
+		m_in_sampleno = s.sampleno + n;
+		m_in_samples += n;
+
+		if (!m_finished && !m_sink(s)) m_finished = true;
+		if (!m_finished) submit(t);
+	}
+}
+
+void StreamDevice::produce() {
+	const size_t n = m_config.chunk;
+	libusb_transfer* t;
+
+	while (m_out_free->pop_wait(t, m_stopping)) {
+		if (t->status != LIBUSB_TRANSFER_COMPLETED && t->status != LIBUSB_TRANSFER_CANCELLED) {
+			m_transfer_errors++;
+		}
+		if (m_finished) continue;
+
+		m_source(m_out_sampleno, &m_out_a[0], &m_out_b[0], n);
+		auto out = (uint16_t*) t->buffer;
+		for (size_t i = 0; i < n; i++) {
+			out[i] = htobe16(m_out_a[i]);
+			out[i+n] = htobe16(m_out_b[i]);
+		}
+		m_out_sampleno += n;
+		m_out_samples = m_out_sampleno;
+		submit(t);
+	}
+}
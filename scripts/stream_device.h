@@ -0,0 +1,151 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include <libusb-1.0/libusb.h>
+
+#include "transfers.h"
+#include "spsc_ring.h"
+#include "unpack.h"
+
+/// One chunk of IN samples, deinterleaved and in host byte order.
+struct Samples {
+	uint64_t sampleno;  // index of the first sample since start(), counting lost chunks
+	size_t count;
+	const uint16_t* v_a;
+	const uint16_t* i_a;
+	const uint16_t* v_b;
+	const uint16_t* i_b;
+};
+
+/// Fills `count` DAC words per channel, in host byte order, starting at
+/// output sample `sampleno`. Runs on the producer thread.
+typedef std::function<void(uint64_t sampleno, uint16_t* a, uint16_t* b, size_t count)> OutSource;
+
+/// Consumes one chunk; returns false once it wants no more.
+/// Runs on the consumer thread.
+typedef std::function<bool(const Samples&)> InSink;
+
+struct StreamConfig {
+	uint16_t period = 480;          // 48MHz ticks per channel, two per sample; request 0xC5
+	unsigned chunk = 256;           // samples per channel per packet, request 0xC6
+	unsigned in_transfers = 8;      // IN transfers kept in flight
+	unsigned out_transfers = 8;
+};
+
+/// A control request with no data stage, for StreamDevice::commands()
+struct Command {
+	uint8_t request;
+	uint16_t value;
+	uint16_t index;
+};
+
+/// Paths in the order of the calibration file: A measure V, A measure I,
+/// A source V, A source I, then the same for B.
+struct Calibration {
+	uint32_t sequence;              // bumped on each write to the device
+	CalEntry path[8];
+
+	/// the measurement paths of the IN planes V_A, I_A, V_B, I_B, for unpack_float()
+	void planes(const CalEntry* out[4]) const {
+		out[0] = &path[0];
+		out[1] = &path[1];
+		out[2] = &path[4];
+		out[3] = &path[5];
+	}
+};
+
+/// Counters for a stream, readable from any thread while it runs.
+struct StreamCounters {
+	uint64_t in_samples;            // samples handed to the sink
+	uint64_t out_samples;           // samples taken from the source
+	uint64_t lost_chunks;           // sequence gaps: chunks the device dropped
+	uint64_t stale_chunks;          // repeated or out-of-order sequence numbers, discarded
+	uint64_t underrun_chunks;       // chunks the device played late OUT data for
+	uint64_t transfer_errors;
+	size_t in_ring_high_water;      // most completed IN transfers awaiting the consumer
+	size_t out_ring_high_water;     // most completed OUT transfers awaiting the producer
+};
+
+/// Continuous streaming from one device.
+///
+/// libusb completion callbacks never touch sample data. They hand the
+/// completed transfer to the consumer (IN) or producer (OUT) thread through
+/// an SpscRing, and the worker resubmits it once it has been processed, so a
+/// slow worker holds back resubmission rather than losing data on the host.
+/// The device's own overrun and underrun reporting then shows any shortfall.
+struct StreamDevice {
+	StreamDevice(libusb_device_handle* handle): m_usb(handle) {}
+	~StreamDevice();
+
+	void claim();
+	void release();
+
+	/// Run requests in order, batched into 0x78 command lists, or one control
+	/// transfer each on firmware without them. Stops at the first that fails
+	/// and returns its index, or -1 if all succeeded.
+	int commands(const std::vector<Command>& cmds);
+
+	/// Read the calibration table kept on the device. False if it has none,
+	/// or with firmware that predates request 0x7E.
+	bool calibration(Calibration& out);
+
+	/// configure the device and start streaming until stop()
+	bool start(const StreamConfig& config, OutSource source, InSink sink);
+
+	/// block until the sink has declined further samples
+	void wait();
+
+	void stop();
+
+	StreamCounters counters() const;
+
+	libusb_device_handle* const m_usb;
+
+	// internal: called from the libusb completion callbacks
+	void in_completed(libusb_transfer* t);
+	void out_completed(libusb_transfer* t);
+
+private:
+	void consume();
+	void produce();
+	void submit(libusb_transfer* t);
+
+	StreamConfig m_config;
+	OutSource m_source;
+	InSink m_sink;
+
+	Transfers m_in_transfers;
+	Transfers m_out_transfers;
+	std::unique_ptr<SpscRing<libusb_transfer*>> m_in_ready;    // USB thread -> consumer
+	std::unique_ptr<SpscRing<libusb_transfer*>> m_out_free;    // USB thread -> producer
+
+	std::thread m_usb_thread;
+	std::thread m_consumer;
+	std::thread m_producer;
+	std::atomic<bool> m_stopping{false};
+	std::atomic<bool> m_finished{false};
+	std::atomic<bool> m_events_done{false};
+	std::atomic<int> m_in_flight{0};
+	bool m_running = false;
+
+	// Owned by the consumer thread
+	uint64_t m_in_sampleno = 0;
+	uint64_t m_next_seq = 0;   // device sequence number, extended
+	std::vector<uint16_t> m_planes;
+
+	// Owned by the producer thread
+	uint64_t m_out_sampleno = 0;
+	std::vector<uint16_t> m_out_a, m_out_b;
+
+	std::atomic<uint64_t> m_in_samples{0};
+	std::atomic<uint64_t> m_out_samples{0};
+	std::atomic<uint64_t> m_lost_chunks{0};
+	std::atomic<uint64_t> m_stale_chunks{0};
+	std::atomic<uint64_t> m_underrun_chunks{0};
+	std::atomic<uint64_t> m_transfer_errors{0};
+};
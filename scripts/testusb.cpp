@@ -1,263 +1,77 @@
 #include <iostream>
-#include <thread>
-#include <mutex>
-#include <condition_variable>
 #include <vector>
 #include <libusb-1.0/libusb.h>
 #include <math.h>
-#include <endian.h>
+#include <stdlib.h>
 
-const size_t chunk_size = 256;
+#include "stream_device.h"
 
-extern "C" void LIBUSB_CALL in_completion(libusb_transfer *t);
-extern "C" void LIBUSB_CALL out_completion(libusb_transfer *t);
-
-struct Transfers {
-	std::vector<libusb_transfer*> m_transfers;
-	
-	void alloc(unsigned count, libusb_device_handle* handle,
-	           unsigned char endpoint, unsigned char type, size_t buf_size,
-	           unsigned timeout, libusb_transfer_cb_fn callback, void* user_data) {
-		m_transfers.resize(count, NULL);
-		for (size_t i=0; i<count; i++) {
-			auto t = m_transfers[i] = libusb_alloc_transfer(0);
-			t->dev_handle = handle;
-			t->flags = LIBUSB_TRANSFER_FREE_BUFFER;
-			t->endpoint = endpoint;
-			t->type = type;
-			t->timeout = timeout;
-			t->length = buf_size;
-			t->callback = callback;
-			t->user_data = user_data;
-			t->buffer = (uint8_t*) malloc(buf_size);
-		}
-	}
-	
-	void clear() {
-		for (auto i: m_transfers) {
-			libusb_free_transfer(i);
-		}
-		m_transfers.clear();
-	}
-	
-	size_t size() {
-		return m_transfers.size();
-	}
-	
-	~Transfers() {
-		clear();
-	}
-	
-	typedef std::vector<libusb_transfer*>::iterator iterator;
-	typedef std::vector<libusb_transfer*>::const_iterator const_iterator;
-	iterator begin() { return m_transfers.begin(); }
-	const_iterator begin() const { return m_transfers.begin(); }
-	iterator end() { return m_transfers.end(); }
-	const_iterator end() const { return m_transfers.end(); }
-};
-
-struct HeliumDevice {
-	HeliumDevice(libusb_device_handle* handle): m_usb(handle) {}
-	~HeliumDevice() {
-		libusb_close(m_usb);
-	}
-	
-	void claim() {
-		libusb_claim_interface(m_usb, 0);
-		libusb_set_interface_alt_setting(m_usb, 0, 1);
-	}
-	
-	void release() {
-		libusb_release_interface(m_usb, 0);
-	}
-	
-	void config_sync(uint64_t sample_rate, uint64_t sample_count) {
-		m_sample_rate = sample_rate;
-		m_sample_count = sample_count;
-		m_in_transfers.alloc(6, m_usb, 0x81, LIBUSB_TRANSFER_TYPE_BULK, 2048, 1000, in_completion, this);
-		m_out_transfers.alloc(6, m_usb, 0x02, LIBUSB_TRANSFER_TYPE_BULK, 1024, 1000, out_completion, this);
-	}
-	
-	void start() {
-		uint8_t buf[4];
-		// set pots for sane simv
-		libusb_control_transfer(m_usb, 0x40|0x80, 0x1B, 0x0707, 'a', buf, 4, 100);
-		// set adcs for bipolar sequenced mode
-		libusb_control_transfer(m_usb, 0x40|0x80, 0xCA, 0xF120, 0xF520, buf, 1, 100);
-		libusb_control_transfer(m_usb, 0x40|0x80, 0xCB, 0xF120, 0xF520, buf, 1, 100);
-		// set timer for 1us keepoff, 20us period
-		libusb_control_transfer(m_usb, 0x40|0x80, 0xC5, 0x0001, 0x003e, buf, 1, 100);
-		
-		std::lock_guard<std::mutex> lock(m_state);
-		m_requested_sampleno = m_in_sampleno = m_out_sampleno = 0;
-		
-		for (auto i: m_in_transfers) {
-			if (!submit_in_transfer(i)) break;
-		}
-		
-		for (auto i: m_out_transfers) {
-			if (!submit_out_transfer(i)) break;
-		}
-	}
-	void stop() {
-		uint8_t buf[4];
-		libusb_control_transfer(m_usb, 0x40|0x80, 0xC5, 0x0000, 0x0000, buf, 1, 100);
-	}
-	
-	bool submit_out_transfer(libusb_transfer* t) {
-		if (m_sample_count == 0 || m_out_sampleno < m_sample_count + 512) { //TODO: firmware bug that we have to send an extra packet
-			std::cerr << "submit_out_transfer " << m_out_sampleno << std::endl;
-			auto buf = (uint16_t*) t->buffer;
-			for (size_t i = 0; i < chunk_size; i++) {
-				buf[i] = buf[i+chunk_size] = htobe16(m_src_buf[m_out_sampleno++]);
-			}
-			
-			int r = libusb_submit_transfer(t);
-			return true;
-		}
-		return false;
-	}
-	
-	bool submit_in_transfer(libusb_transfer* t) {
-		if (m_sample_count == 0 || m_requested_sampleno < m_sample_count) {
-			std::cerr << "submit_in_transfer " << m_requested_sampleno << std::endl;
-			int r = libusb_submit_transfer(t);
-			m_requested_sampleno += chunk_size;
-			return true;
-		}
-		return false;
-	}
-	
-	void handle_in_transfer(libusb_transfer* t) {
-		std::cerr << "handle_in_transfer " << m_in_sampleno << std::endl;
-		
-		auto buf = (uint16_t*) t->buffer;
-		for (size_t i = 0; i < chunk_size; i++) {
-			m_dest_buf_v_a[m_in_sampleno  ] = be16toh(buf[i]);
-			m_dest_buf_i_a[m_in_sampleno  ] = be16toh(buf[i+chunk_size]);
-			m_dest_buf_v_b[m_in_sampleno  ] = be16toh(buf[i+chunk_size*2]);
-			m_dest_buf_i_b[m_in_sampleno++] = be16toh(buf[i+chunk_size*3]);
-		}
-		
-		if (m_in_sampleno >= m_sample_count) {
-			m_completion.notify_all();
-		}
-	}
-	
-	void wait() {
-		std::unique_lock<std::mutex> lk(m_state);
-		m_completion.wait(lk, [&]{ return m_in_sampleno >= m_sample_count; });
+int main(int argc, char** argv)
+{
+	if (libusb_init(NULL) < 0) {
+		std::cerr << "Could not init libusb" << std::endl;
+		abort();
 	}
-	
-	libusb_device_handle* const m_usb;
-	Transfers m_in_transfers;
-	Transfers m_out_transfers;
-	
-	std::mutex m_state;
-	std::condition_variable m_completion;
-	
-	uint64_t m_sample_rate;
-	uint64_t m_sample_count;
-	
-	// State owned by USB thread
-	uint16_t m_requested_sampleno;
-	uint64_t m_in_sampleno;
-	uint64_t m_out_sampleno;
 
-	uint16_t* m_src_buf;
-	uint16_t* m_dest_buf_v_a;
-	uint16_t* m_dest_buf_i_a;
-	uint16_t* m_dest_buf_v_b;
-	uint16_t* m_dest_buf_i_b;
-};
+	libusb_set_debug(NULL, 2);
 
-/// Runs in USB thread
-extern "C" void LIBUSB_CALL in_completion(libusb_transfer *t){
-	if (!t->user_data){
-		libusb_free_transfer(t); // user_data was zeroed out when device was deleted
-		return;
+	libusb_device_handle* handle = libusb_open_device_with_vid_pid(NULL, 0x064B, 0x784C);
+	if (!handle) handle = libusb_open_device_with_vid_pid(NULL, 0x0456, 0xCEE2);
+	if (!handle) {
+		std::cerr << "Device not found" << std::endl;
+		return 1;
 	}
 
-	HeliumDevice *dev = (HeliumDevice *) t->user_data;
-	std::lock_guard<std::mutex> lock(dev->m_state);
-	
-	if (t->status == LIBUSB_TRANSFER_COMPLETED){
-		dev->handle_in_transfer(t);
-		dev->submit_in_transfer(t);
-	}else{
-		std::cerr << "ITransfer error "<< t->status << " " << t << std::endl;
-		//TODO: notify main thread of error
-	}
-}
+	// sample count, 0 to stream until interrupted
+	const uint64_t len = argc > 1 ? strtoull(argv[1], NULL, 0) : (1<<16);
+	const bool keep = len != 0;
 
-/// Runs in USB thread
-extern "C" void LIBUSB_CALL out_completion(libusb_transfer *t){
-	if (!t->user_data) {
-		libusb_free_transfer(t); // user_data was zeroed out when device was deleted
-		return;
+	std::vector<uint16_t> in_v_a, in_i_a, in_v_b, in_i_b;
+	if (keep) {
+		in_v_a.resize(len);
+		in_i_a.resize(len);
+		in_v_b.resize(len);
+		in_i_b.resize(len);
 	}
 
-	HeliumDevice *dev = (HeliumDevice *) t->user_data;
-	std::lock_guard<std::mutex> lock(dev->m_state);
-	
-	if (t->status == LIBUSB_TRANSFER_COMPLETED){
-		dev->submit_out_transfer(t);
-	}else{
-		std::cerr << "OTransfer error "<< t->status << " " << t << std::endl;
-	}
-}
+	auto target = [](uint64_t i) -> uint16_t {
+		return 0;//(1<<13) + uint16_t(sin(M_PI*2.0*double(i)/double((1<<8)-1))*double((1<<13)-1));
+	};
 
+	auto source = [&](uint64_t sampleno, uint16_t* a, uint16_t* b, size_t count) {
+		for (size_t i = 0; i < count; i++) {
+			a[i] = b[i] = target(sampleno + i);
+		}
+	};
 
+	auto sink = [&](const Samples& s) {
+		if (!keep) return true;
+		for (size_t i = 0; i < s.count && s.sampleno + i < len; i++) {
+			in_v_a[s.sampleno + i] = s.v_a[i];
+			in_i_a[s.sampleno + i] = s.i_a[i];
+			in_v_b[s.sampleno + i] = s.v_b[i];
+			in_i_b[s.sampleno + i] = s.i_b[i];
+		}
+		return s.sampleno + s.count < len;
+	};
+
+	StreamDevice dev(handle);
+	StreamConfig config;
 
-int main()
-{
-	if (libusb_init(NULL) < 0) {
-		std::cerr << "Could not init libusb" << std::endl;
-		abort();
-	}
-	
-	libusb_set_debug(NULL, 2);
-	
-	// Dedicated thread for handling soft-real-time USB events
-	std::thread usb_thread([]() {
-		while(1) libusb_handle_events(NULL);
-	});
-	
-	libusb_device_handle* handle = libusb_open_device_with_vid_pid(NULL, 0x0456, 0xCEE2);
-	
-	if (!handle) {
-		std::cerr << "Device not found" << std::endl;
-	}
-	
-	const size_t len = (1<<16);
-	uint16_t out[len];
-	for (size_t i=0; i<len; i++) {
-		out[i] = 0;//(1<<13) + uint16_t(sin(M_PI*2.0*double(i)/double((1<<8)-1))*double((1<<13)-1));
-	}
-	uint16_t in_v_a[len];
-	uint16_t in_v_b[len];
-	uint16_t in_i_a[len];
-	uint16_t in_i_b[len];
-		
-	HeliumDevice dev(handle);
-	
-	dev.m_src_buf = out;
-	dev.m_dest_buf_v_a = in_v_a;
-	dev.m_dest_buf_v_b = in_v_b;
-	dev.m_dest_buf_i_a = in_i_a;
-	dev.m_dest_buf_i_b = in_i_b;
-	
 	dev.claim();
-	dev.config_sync(0, len);
-	dev.start();
+	if (!dev.start(config, source, sink)) return 1;
 	dev.wait();
-	dev.stop();	
+	dev.stop();
 	dev.release();
-	
+
+	auto c = dev.counters();
+	std::cerr << "lost chunks " << c.lost_chunks << ", stale " << c.stale_chunks << ", underruns " << c.underrun_chunks
+	          << ", transfer errors " << c.transfer_errors << std::endl;
+
 	for (size_t i=0; i<len; i++) {
-		std::cout << out[i] << ", " << in_v_a[i] << ", " << in_i_a[i] << ", " << in_v_b[i] << ", " << in_i_b[i] << std::endl;
+		std::cout << target(i) << ", " << in_v_a[i] << ", " << in_i_a[i] << ", " << in_v_b[i] << ", " << in_i_b[i] << std::endl;
 	}
 
-	exit(0); //TODO: stop libusb properly
-	usb_thread.join();
+	libusb_close(handle);
+	libusb_exit(NULL);
 }
@@ -0,0 +1,225 @@
+#include "unpack.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define UNPACK_X86 1
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define UNPACK_ARM 1
+#endif
+
+static inline uint16_t load_be16(const uint8_t* p) {
+	return (uint16_t) (p[0] << 8 | p[1]);
+}
+
+// ---------------------------------------------------------------------------
+// Scalar reference, also used for the tails of the vector kernels
+
+static void planar_tail(const uint8_t* in, size_t n, size_t from, uint16_t* const out[4]) {
+	for (size_t k = 0; k < 4; k++) {
+		for (size_t i = from; i < n; i++) {
+			out[k][i] = load_be16(in + 2*(k*n + i));
+		}
+	}
+}
+
+static void interleaved_tail(const uint8_t* in, size_t n, size_t from, uint16_t* const out[4]) {
+	for (size_t i = from; i < n; i++) {
+		for (size_t k = 0; k < 4; k++) {
+			out[k][i] = load_be16(in + 2*(i*4 + k));
+		}
+	}
+}
+
+static void planar_scalar(const uint8_t* in, size_t n, uint16_t* const out[4]) {
+	planar_tail(in, n, 0, out);
+}
+
+static void interleaved_scalar(const uint8_t* in, size_t n, uint16_t* const out[4]) {
+	interleaved_tail(in, n, 0, out);
+}
+
+#ifdef UNPACK_X86
+// ---------------------------------------------------------------------------
+// SSE2: 8 samples per vector. Part of the x86-64 baseline, so always usable.
+
+static inline __m128i swap16_sse2(__m128i x) {
+	return _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+}
+
+static void planar_sse2(const uint8_t* in, size_t n, uint16_t* const out[4]) {
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		for (size_t k = 0; k < 4; k++) {
+			__m128i x = _mm_loadu_si128((const __m128i*) (in + 2*(k*n + i)));
+			_mm_storeu_si128((__m128i*) (out[k] + i), swap16_sse2(x));
+		}
+	}
+	planar_tail(in, n, i, out);
+}
+
+static void interleaved_sse2(const uint8_t* in, size_t n, uint16_t* const out[4]) {
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		const __m128i* p = (const __m128i*) (in + 8*i);
+		// two samples of {V_A, I_A, V_B, I_B} per vector
+		__m128i a0 = _mm_loadu_si128(p);
+		__m128i a1 = _mm_loadu_si128(p + 1);
+		__m128i a2 = _mm_loadu_si128(p + 2);
+		__m128i a3 = _mm_loadu_si128(p + 3);
+		// 4x4 transpose of 16-bit words in three rounds of unpacks
+		__m128i t0 = _mm_unpacklo_epi16(a0, a1);
+		__m128i t1 = _mm_unpackhi_epi16(a0, a1);
+		__m128i t2 = _mm_unpacklo_epi16(a2, a3);
+		__m128i t3 = _mm_unpackhi_epi16(a2, a3);
+		__m128i u0 = _mm_unpacklo_epi16(t0, t1);   // V_A 0-3, I_A 0-3
+		__m128i u1 = _mm_unpackhi_epi16(t0, t1);   // V_B 0-3, I_B 0-3
+		__m128i u2 = _mm_unpacklo_epi16(t2, t3);   // V_A 4-7, I_A 4-7
+		__m128i u3 = _mm_unpackhi_epi16(t2, t3);   // V_B 4-7, I_B 4-7
+		_mm_storeu_si128((__m128i*) (out[0] + i), swap16_sse2(_mm_unpacklo_epi64(u0, u2)));
+		_mm_storeu_si128((__m128i*) (out[1] + i), swap16_sse2(_mm_unpackhi_epi64(u0, u2)));
+		_mm_storeu_si128((__m128i*) (out[2] + i), swap16_sse2(_mm_unpacklo_epi64(u1, u3)));
+		_mm_storeu_si128((__m128i*) (out[3] + i), swap16_sse2(_mm_unpackhi_epi64(u1, u3)));
+	}
+	interleaved_tail(in, n, i, out);
+}
+
+// ---------------------------------------------------------------------------
+// AVX2: 16 samples per vector, selected at run time
+
+#define AVX2_FN __attribute__((target("avx2")))
+
+AVX2_FN static inline __m256i swap16_avx2(__m256i x) {
+	const __m256i mask = _mm256_setr_epi8(
+		1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+		1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+	return _mm256_shuffle_epi8(x, mask);
+}
+
+AVX2_FN static void planar_avx2(const uint8_t* in, size_t n, uint16_t* const out[4]) {
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		for (size_t k = 0; k < 4; k++) {
+			__m256i x = _mm256_loadu_si256((const __m256i*) (in + 2*(k*n + i)));
+			_mm256_storeu_si256((__m256i*) (out[k] + i), swap16_avx2(x));
+		}
+	}
+	planar_tail(in, n, i, out);
+}
+
+AVX2_FN static void interleaved_avx2(const uint8_t* in, size_t n, uint16_t* const out[4]) {
+	// The SSE2 transpose runs in each 128-bit lane, leaving lane 0 with
+	// samples {0,1,4,5,8,9,12,13} and lane 1 with {2,3,6,7,...}; a dword
+	// permute then restores sample order.
+	const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		const __m256i* p = (const __m256i*) (in + 8*i);
+		__m256i a0 = _mm256_loadu_si256(p);
+		__m256i a1 = _mm256_loadu_si256(p + 1);
+		__m256i a2 = _mm256_loadu_si256(p + 2);
+		__m256i a3 = _mm256_loadu_si256(p + 3);
+		__m256i t0 = _mm256_unpacklo_epi16(a0, a1);
+		__m256i t1 = _mm256_unpackhi_epi16(a0, a1);
+		__m256i t2 = _mm256_unpacklo_epi16(a2, a3);
+		__m256i t3 = _mm256_unpackhi_epi16(a2, a3);
+		__m256i u0 = _mm256_unpacklo_epi16(t0, t1);
+		__m256i u1 = _mm256_unpackhi_epi16(t0, t1);
+		__m256i u2 = _mm256_unpacklo_epi16(t2, t3);
+		__m256i u3 = _mm256_unpackhi_epi16(t2, t3);
+		__m256i v[4] = {
+			_mm256_unpacklo_epi64(u0, u2), _mm256_unpackhi_epi64(u0, u2),
+			_mm256_unpacklo_epi64(u1, u3), _mm256_unpackhi_epi64(u1, u3),
+		};
+		for (size_t k = 0; k < 4; k++) {
+			__m256i x = _mm256_permutevar8x32_epi32(v[k], order);
+			_mm256_storeu_si256((__m256i*) (out[k] + i), swap16_avx2(x));
+		}
+	}
+	interleaved_tail(in, n, i, out);
+}
+#endif // UNPACK_X86
+
+#ifdef UNPACK_ARM
+// ---------------------------------------------------------------------------
+// NEON: 8 samples per vector; vld4 does the interleaved split in the load
+
+static void planar_neon(const uint8_t* in, size_t n, uint16_t* const out[4]) {
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		for (size_t k = 0; k < 4; k++) {
+			uint8x16_t x = vld1q_u8(in + 2*(k*n + i));
+			vst1q_u16(out[k] + i, vreinterpretq_u16_u8(vrev16q_u8(x)));
+		}
+	}
+	planar_tail(in, n, i, out);
+}
+
+static void interleaved_neon(const uint8_t* in, size_t n, uint16_t* const out[4]) {
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		uint16x8x4_t x = vld4q_u16((const uint16_t*) (in + 8*i));
+		for (size_t k = 0; k < 4; k++) {
+			uint8x16_t b = vrev16q_u8(vreinterpretq_u8_u16(x.val[k]));
+			vst1q_u16(out[k] + i, vreinterpretq_u16_u8(b));
+		}
+	}
+	interleaved_tail(in, n, i, out);
+}
+#endif // UNPACK_ARM
+
+// ---------------------------------------------------------------------------
+
+static const UnpackKernels kernels[UNPACK_ISA_COUNT] = {
+	{"scalar", planar_scalar, interleaved_scalar},
+#ifdef UNPACK_X86
+	{"sse2", planar_sse2, interleaved_sse2},
+	{"avx2", planar_avx2, interleaved_avx2},
+#else
+	{"sse2", nullptr, nullptr},
+	{"avx2", nullptr, nullptr},
+#endif
+#ifdef UNPACK_ARM
+	{"neon", planar_neon, interleaved_neon},
+#else
+	{"neon", nullptr, nullptr},
+#endif
+};
+
+const UnpackKernels* unpack_kernels(UnpackIsa isa) {
+	if (isa >= UNPACK_ISA_COUNT || !kernels[isa].planar) return nullptr;
+#ifdef UNPACK_X86
+	if (isa == UNPACK_AVX2 && !__builtin_cpu_supports("avx2")) return nullptr;
+#endif
+	return &kernels[isa];
+}
+
+const UnpackKernels& unpack_best() {
+	static const UnpackKernels* best = []() {
+		for (int isa = UNPACK_ISA_COUNT - 1; isa > UNPACK_SCALAR; isa--) {
+			if (auto k = unpack_kernels((UnpackIsa) isa)) return k;
+		}
+		return &kernels[UNPACK_SCALAR];
+	}();
+	return *best;
+}
+
+bool unpack_float(unpack_fn kernel, const uint8_t* in, size_t n,
+                  const CalEntry* const cal[4], float* const out[4]) {
+	uint16_t tmp[4][UNPACK_MAX_SAMPLES];
+	uint16_t* const codes[4] = {tmp[0], tmp[1], tmp[2], tmp[3]};
+
+	if (n > UNPACK_MAX_SAMPLES) return false;
+	kernel(in, n, codes);
+	for (size_t k = 0; k < 4; k++) {
+		const float o = cal[k]->offset / 256.0f;
+		const float gp = cal[k]->gain_pos / 65536.0f, gn = cal[k]->gain_neg / 65536.0f;
+		for (size_t i = 0; i < n; i++) {
+			float d = tmp[k][i] - o;
+			out[k][i] = d * (d >= 0 ? gp : gn);
+		}
+	}
+	return true;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// Kernels that split the samples of an IN packet into four arrays
+/// (V_A, I_A, V_B, I_B) and swap them from the wire's big-endian order.
+///
+/// `in` is the sample data of one packet, after any header, and need not be
+/// aligned. `n` is the number of samples per channel. The planar layout is
+/// V_A[n], I_A[n], V_B[n], I_B[n]; the interleaved layout (request 0xDD) is
+/// {V_A, I_A, V_B, I_B}[n].
+typedef void (*unpack_fn)(const uint8_t* in, size_t n, uint16_t* const out[4]);
+
+struct UnpackKernels {
+	const char* name;
+	unpack_fn planar;
+	unpack_fn interleaved;
+};
+
+enum UnpackIsa {
+	UNPACK_SCALAR,
+	UNPACK_SSE2,
+	UNPACK_AVX2,
+	UNPACK_NEON,
+	UNPACK_ISA_COUNT,
+};
+
+/// kernels for one instruction set, or nullptr if this build or CPU lacks it
+const UnpackKernels* unpack_kernels(UnpackIsa isa);
+
+/// the fastest kernels this CPU supports, chosen once
+const UnpackKernels& unpack_best();
+
+/// One path of the device's calibration table, request 0x7E.
+/// Measurements: value = (code - offset) * gain in uV or uA, with gain_pos
+/// when code >= offset. Sources: code = value / gain + offset.
+struct CalEntry {
+	int32_t offset;     // codes, Q24.8
+	int32_t gain_pos;   // uV or uA per code, Q16.16
+	int32_t gain_neg;
+};
+
+/// largest packet unpack_float() accepts, at least CHUNK_SAMPLES_MAX in the firmware
+const size_t UNPACK_MAX_SAMPLES = 1024;
+
+/// Unpack and convert to uV and uA with plane k's measurement path `cal[k]`,
+/// as request 0xDF does on the device, less its rounding down to whole units.
+/// Uses `kernel` for the split and swap, then a loop the compiler vectorises.
+/// Returns false if `n` exceeds UNPACK_MAX_SAMPLES.
+bool unpack_float(unpack_fn kernel, const uint8_t* in, size_t n,
+                  const CalEntry* const cal[4], float* const out[4]);
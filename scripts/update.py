@@ -0,0 +1,71 @@
+#!/usr/bin/env python
+# Update the firmware of every attached M1K over its vendor bulk endpoint,
+# without rebooting into the SAM-BA ROM:
+#
+#   update.py m1000.bin
+#
+# Needs firmware that already has requests 0xB1-0xB3; older devices still
+# need `make flash`. Devices are updated in parallel, and each keeps its
+# running firmware unless the whole image arrives with the right CRC.
+import usb, usb.util, struct, sys, threading, time, zlib
+
+IDS = [(0x0456, 0xcee2), (0x064b, 0x784c)]
+IDLE, RECEIVING, RECEIVED, FAILED, INSTALLING = range(5)
+ERRORS = ["none", "bulk transfer aborted or short", "staging flash write", "CRC mismatch"]
+IAP_IMAGE_MAX = (0x20000 - 512) // 2
+
+def find_all():
+	return [d for vid, pid in IDS for d in usb.core.find(find_all=True, idVendor=vid, idProduct=pid)]
+
+def status(dev):
+	state, error, _, length, received, crc = struct.unpack("<BBHIII", bytearray(dev.ctrl_transfer(0x40|0x80, 0xB2, 0, 0, 16)))
+	return state, error, received, crc
+
+def update(dev, image, results):
+	serial = usb.util.get_string(dev, dev.iSerialNumber)
+	crc = zlib.crc32(image) & 0xFFFFFFFF
+	try:
+		dev.set_interface_altsetting(0, 1)
+		dev.ctrl_transfer(0x40, 0xC5, 0, 0)    # stop sampling
+		dev.ctrl_transfer(0x40, 0xB1, len(image) & 0xFFFF, len(image) >> 16)
+		dev.write(0x02, image, 20000)
+		# the last chunk is staged and checked after the transfer completes
+		deadline = time.time() + 5
+		while True:
+			state, error, received, staged_crc = status(dev)
+			if state == RECEIVED:
+				break
+			if state != RECEIVING or time.time() > deadline:
+				raise RuntimeError("staging failed after %d bytes: %s" % (received, ERRORS[error]))
+			time.sleep(0.01)
+		if staged_crc != crc:
+			raise RuntimeError("staged CRC %08x, expected %08x" % (staged_crc, crc))
+		dev.ctrl_transfer(0x40, 0xB3, crc & 0xFFFF, crc >> 16)
+		results[serial] = "installed, resetting"
+	except (usb.core.USBError, RuntimeError) as e:
+		try:
+			dev.ctrl_transfer(0x40, 0xB1, 0, 0)    # cancel
+		except usb.core.USBError:
+			pass
+		results[serial] = "failed: %s" % e
+
+if len(sys.argv) != 2:
+	sys.exit("usage: update.py image.bin")
+image = open(sys.argv[1], "rb").read()
+if len(image) > IAP_IMAGE_MAX:
+	sys.exit("%s is larger than the %d bytes an update can carry" % (sys.argv[1], IAP_IMAGE_MAX))
+
+devices = find_all()
+if not devices:
+	sys.exit("no M1K found")
+start = time.time()
+results = {}
+threads = [threading.Thread(target=update, args=(dev, image, results)) for dev in devices]
+for t in threads:
+	t.start()
+for t in threads:
+	t.join()
+for serial in sorted(results):
+	print("%s: %s" % (serial, results[serial]))
+print("%d device(s) in %.1fs" % (len(devices), time.time() - start))
+sys.exit(0 if all(r.startswith("installed") for r in results.values()) else 1)
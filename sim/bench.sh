@@ -0,0 +1,21 @@
+#!/bin/sh
+# Run benchstream against a private simulator instance, with and without
+# injected host stalls: 60ms every 500ms outlasts the default ring. Extra arguments are passed to benchstream.
+set -u
+cd "$(dirname "$0")"
+export M1K_SIM_SOCKET="${TMPDIR:-/tmp}/m1k-sim-bench.$$"
+ARGS="${*:-480 5 256}"
+
+run() {
+	echo "== m1k-sim $1"
+	./m1k-sim $1 &
+	pid=$!
+	while [ ! -S "$M1K_SIM_SOCKET" ]; do sleep 0.1; done
+	../scripts/benchstream $ARGS
+	echo "benchstream exit $?"
+	kill $pid
+	wait $pid
+}
+
+run ""
+run "-S 60 -e 500"
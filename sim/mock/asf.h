@@ -0,0 +1,167 @@
+#ifndef _SIM_ASF_H_
+#define _SIM_ASF_H_
+
+// Stand-in for ASF when the firmware is built for the host simulator.
+// Declares just the registers, drivers and USB device API the firmware
+// uses; sim_hw.c and sim_usb.c implement them. Peripheral register blocks
+// are plain structs, and PDC pointer registers hold 32-bit addresses, so
+// the simulator must be linked without PIE to keep statics below 4GB.
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#define UNUSED(v) (void)(v)
+#define unlikely(x) __builtin_expect(!!(x),0)
+#define likely(x) __builtin_expect(!!(x),1)
+#define RAMFUNC
+#define COMPILER_WORD_ALIGNED __attribute__((aligned(4)))
+#define COMPILER_PACK_SET(a)
+#define COMPILER_PACK_RESET()
+#define Min(a,b) (((a)<(b))?(a):(b))
+#define Max(a,b) (((a)>(b))?(a):(b))
+typedef uint16_t le16_t;
+typedef uint32_t iram_size_t;
+typedef uint8_t udd_ep_id_t;
+typedef enum { UDD_EP_TRANSFER_OK=0, UDD_EP_TRANSFER_ABORT=1 } udd_ep_status_t;
+typedef void (*udd_callback_trans_t)(udd_ep_status_t, iram_size_t, udd_ep_id_t);
+typedef struct { uint8_t bmRequestType, bRequest; uint16_t wValue, wIndex, wLength; } usb_setup_req_t;
+typedef struct { usb_setup_req_t req; uint8_t *payload; uint16_t payload_size; void (*callback)(void); bool (*over_under_run)(void);} udd_ctrl_request_t;
+extern udd_ctrl_request_t udd_g_ctrlreq;
+#define USB_REQ_TYPE_MASK (3<<5)
+#define USB_REQ_TYPE_VENDOR (2<<5)
+#define USB_REQ_DIR_IN (1<<7)
+#define Udd_setup_type() (udd_g_ctrlreq.req.bmRequestType & USB_REQ_TYPE_MASK)
+#define Udd_setup_is_in() (udd_g_ctrlreq.req.bmRequestType & USB_REQ_DIR_IN)
+#define Udd_setup_is_out() (!Udd_setup_is_in())
+typedef struct { uint8_t bLength, bDescriptorType; } usb_str_desc_t;
+#define USB_DT_STRING 3
+#define UDC_DESC_STORAGE
+#define cpu_to_le16(x) (x)
+#define UDI_VENDOR_EP_BULK_IN 0x81
+#define UDI_VENDOR_EP_BULK_OUT 0x02
+bool udi_vendor_bulk_in_run(uint8_t*, iram_size_t, udd_callback_trans_t);
+bool udi_vendor_bulk_out_run(uint8_t*, iram_size_t, udd_callback_trans_t);
+void udd_ep_abort(udd_ep_id_t);
+typedef struct { volatile uint32_t TC_CCR, TC_CMR, TC_SMMR, r0, TC_CV, TC_RA, TC_RB, TC_RC, TC_SR, TC_IER, TC_IDR, TC_IMR; } TcChannel;
+typedef struct { TcChannel TC_CHANNEL[3]; } Tc;
+extern Tc sim_tc0;
+#define TC0 (&sim_tc0)
+void tc_start(Tc*, uint32_t); void tc_stop(Tc*, uint32_t);
+void tc_write_ra(Tc*, uint32_t, uint32_t); void tc_write_rb(Tc*, uint32_t, uint32_t); void tc_write_rc(Tc*, uint32_t, uint32_t);
+void tc_init(Tc*, uint32_t, uint32_t); void tc_enable_interrupt(Tc*, uint32_t, uint32_t);
+typedef struct { volatile uint32_t US_CR, US_MR, US_IER, US_IDR, US_IMR, US_CSR, US_RHR, US_THR; volatile uint32_t US_RPR, US_RCR, US_TPR, US_TCR, US_RNPR, US_RNCR, US_TNPR, US_TNCR, US_PTCR, US_PTSR; } Usart;
+extern Usart sim_usart0, sim_usart1, sim_usart2;
+#define USART0 (&sim_usart0)
+#define USART1 (&sim_usart1)
+#define USART2 (&sim_usart2)
+#define US_CSR_TXEMPTY (1u<<9)
+#define US_CSR_ENDTX (1u<<4)
+#define US_IER_TXEMPTY (1u<<9)
+#define US_IDR_TXEMPTY (1u<<9)
+#define US_PTCR_TXTEN 1
+#define US_PTCR_RXTEN 2
+typedef struct { volatile uint32_t PIO_PER, PIO_PDR, PIO_PSR, PIO_OER, PIO_ODR, PIO_OSR, PIO_SODR, PIO_CODR, PIO_ODSR, PIO_PDSR, PIO_OWER, PIO_OWDR, PIO_OWSR; } Pio;
+extern Pio sim_pioa, sim_piob;
+#define PIOA (&sim_pioa)
+#define PIOB (&sim_piob)
+#define PIO_PB0 (1u<<0)
+#define PIO_PB1 (1u<<1)
+#define PIO_PB2 (1u<<2)
+#define PIO_PB3 (1u<<3)
+#define PIO_PB5 (1u<<5)
+#define PIO_PB6 (1u<<6)
+#define PIO_PB7 (1u<<7)
+#define PIO_PB8 (1u<<8)
+#define PIO_PB19 (1u<<19)
+#define PIO_PB20 (1u<<20)
+#define LOW 0
+#define HIGH 1
+#define DISABLE 0
+#define ENABLE 1
+void pio_set(Pio*, uint32_t); void pio_clear(Pio*, uint32_t);
+void pio_set_output(Pio*, uint32_t, uint32_t, uint32_t, uint32_t);
+void pio_set_input(Pio*, uint32_t, uint32_t);
+void pio_enable_output_write(Pio*, uint32_t); void pio_disable_output_write(Pio*, uint32_t);
+uint32_t pio_get_pin_value(uint32_t);
+typedef struct { volatile uint32_t UDPHS_CTRL, UDPHS_FNUM; } Udphs;
+extern Udphs sim_udphs;
+#define UDPHS (&sim_udphs)
+typedef struct { volatile uint32_t TWI_CR, TWI_MMR, TWI_SMR, TWI_IADR, TWI_CWGR, r[3], TWI_SR, TWI_IER, TWI_IDR, TWI_IMR, TWI_RHR, TWI_THR; } Twi;
+extern Twi sim_twi0;
+#define TWI0 (&sim_twi0)
+#define TWI_CR_START (1u<<0)
+#define TWI_CR_STOP (1u<<1)
+#define TWI_MMR_MREAD (1u<<12)
+#define TWI_MMR_DADR(v) (((uint32_t)(v)&0x7f)<<16)
+#define TWI_SR_TXCOMP (1u<<0)
+#define TWI_SR_RXRDY (1u<<1)
+#define TWI_SR_TXRDY (1u<<2)
+#define TWI_SR_NACK (1u<<8)
+#define TWI_IER_TXCOMP TWI_SR_TXCOMP
+#define TWI_IER_RXRDY TWI_SR_RXRDY
+#define TWI_IER_TXRDY TWI_SR_TXRDY
+#define TWI_IER_NACK TWI_SR_NACK
+#define TWI_IDR_TXCOMP TWI_SR_TXCOMP
+#define TWI_IDR_RXRDY TWI_SR_RXRDY
+#define TWI_IDR_TXRDY TWI_SR_TXRDY
+#define TWI_IDR_NACK TWI_SR_NACK
+typedef enum { TWI0_IRQn = 18, USART0_IRQn = 13, HSMCI_IRQn = 17 } IRQn_Type;
+void NVIC_SetPriority(IRQn_Type, uint32_t); void NVIC_EnableIRQ(IRQn_Type);
+void NVIC_SetPendingIRQ(IRQn_Type);
+#define __NVIC_PRIO_BITS 4
+uint32_t __get_BASEPRI(void); void __set_BASEPRI(uint32_t);
+enum sleepmgr_mode { SLEEPMGR_ACTIVE, SLEEPMGR_SLEEP_WFE, SLEEPMGR_SLEEP_WFI, SLEEPMGR_WAIT_FAST, SLEEPMGR_WAIT, SLEEPMGR_BACKUP };
+void sleepmgr_init(void); void sleepmgr_enter_sleep(void);
+void sleepmgr_lock_mode(enum sleepmgr_mode); void sleepmgr_unlock_mode(enum sleepmgr_mode);
+#define F_CPU 96000000
+void cpu_delay_us(uint32_t, uint32_t);
+uint32_t flash_clear_gpnvm(uint32_t);
+uint32_t flash_set_gpnvm(uint32_t);
+extern uint8_t sim_flash[];
+#define IFLASH0_ADDR ((uint32_t)(uintptr_t)sim_flash)
+#define IFLASH0_SIZE 0x20000
+#define IFLASH0_PAGE_SIZE 256
+#define FLASH_RC_OK 0
+#define FLASH_RC_INVALID 2
+uint32_t flash_unlock(uint32_t, uint32_t, uint32_t*, uint32_t*);
+uint32_t flash_write(uint32_t, const void*, uint32_t, uint32_t);
+typedef struct { volatile uint32_t EEFC_FMR, EEFC_FCR, EEFC_FSR, EEFC_FRR; } Efc;
+extern Efc sim_efc0;
+#define EFC0 (&sim_efc0)
+#define EEFC_FCR_FKEY(v) (((uint32_t)(v)&0xff)<<24)
+#define EEFC_FCR_FARG(v) (((uint32_t)(v)&0xffff)<<8)
+#define EEFC_FCR_FCMD(v) ((uint32_t)(v)&0xff)
+#define EEFC_FSR_FRDY (1u<<0)
+#define EFC_FCMD_EWP 0x03
+#define EFC_FCMD_SGPB 0x0B
+void NVIC_SystemReset(void) __attribute__((noreturn));
+void irq_initialize_vectors(void); void cpu_irq_enable(void); void cpu_irq_disable(void); void sysclk_init(void);
+typedef struct { volatile uint32_t WDT_CR, WDT_MR, WDT_SR; } Wdt;
+extern Wdt sim_wdt;
+#define WDT (&sim_wdt)
+#define WDT_MR_WDRSTEN (1u<<13)
+#define WDT_CR_WDRSTT (1u<<0)
+#define WDT_CR_KEY(v) (((uint32_t)(v)&0xff)<<24)
+void wdt_init(Wdt*, uint32_t, uint16_t, uint16_t); void wdt_restart(Wdt*);
+void udc_detach(void); void udc_stop(void); void udc_start(void); void udc_attach(void);
+
+typedef struct { volatile uint32_t DHCSR, DCRSR, DCRDR, DEMCR; } CoreDebug_Type;
+typedef struct { volatile uint32_t CTRL, CYCCNT; } DWT_Type;
+extern CoreDebug_Type sim_coredebug;
+extern DWT_Type sim_dwt;
+#define CoreDebug (&sim_coredebug)
+#define DWT (&sim_dwt)
+#define CoreDebug_DEMCR_TRCENA_Msk (1u<<24)
+#define DWT_CTRL_CYCCNTENA_Msk (1u<<0)
+
+typedef uint32_t irqflags_t;
+irqflags_t cpu_irq_save(void);
+void cpu_irq_restore(irqflags_t flags);
+
+#define UDPHS_FNUM_MICRO_FRAME_NUM_Msk (0x7u)
+#define UDPHS_FNUM_FRAME_NUMBER_Msk (0x7ffu<<3)
+#define TC_CCR_CLKEN (1u<<0)
+#define TC_CCR_CLKDIS (1u<<1)
+#define __REV16(v) ((((uint32_t)(v)&0xff00ff00)>>8)|(((uint32_t)(v)&0x00ff00ff)<<8))
+
+#endif // _SIM_ASF_H_
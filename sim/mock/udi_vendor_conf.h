@@ -0,0 +1 @@
+#include "asf.h"
@@ -0,0 +1,234 @@
+// Host-side simulator for the M1000 firmware.
+//
+// Runs main.c and bulk_sampling.c against mocked peripherals, driven by a
+// simulated TC0 channel 2 and USB microframe clock, and serves the vendor
+// USB protocol on a Unix socket. Host programs reach it through the libusb
+// shim in this directory (make SIM=1 in scripts/), so the streaming
+// benchmarks run on any Linux machine, with faults injected on the host side.
+//
+// usage: m1k-sim [-s socket] [-b bytes/us] [-j jitter us]
+//                [-S stall ms] [-e stall every ms] [-f flash file] [-v]
+
+#define _GNU_SOURCE     // ppoll
+#include "sim.h"
+#include "main.h"
+#include "bulk_sampling.h"
+#include "profile.h"
+#include "power_monitor.h"
+#include "calibration.h"
+#include "iap.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+sim_time_t sim_now;
+
+static volatile sig_atomic_t quit;
+static bool verbose;
+
+static sim_time_t wall_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (sim_time_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void on_signal(int sig)
+{
+    quit = 1;
+}
+
+static int listen_on(const char * path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "m1k-sim: socket path too long\n");
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        perror("m1k-sim: listen");
+        return -1;
+    }
+    return fd;
+}
+
+static bool read_full(int fd, void * buf, size_t n)
+{
+    uint8_t * p = buf;
+    while (n) {
+        ssize_t r = read(fd, p, n);
+        if (r <= 0)
+            return false;
+        p += r;
+        n -= r;
+    }
+    return true;
+}
+
+/// Read and handle one message; false once the host has gone
+static bool read_message(int fd)
+{
+    static uint8_t * data;
+    static uint32_t data_size;
+    sim_msg_t msg;
+
+    if (!read_full(fd, &msg, sizeof(msg)))
+        return false;
+    if (msg.length > data_size) {
+        data = realloc(data, msg.length);
+        data_size = msg.length;
+    }
+    if (msg.length && !read_full(fd, data, msg.length))
+        return false;
+    sim_usb_message(&msg, data);
+    return true;
+}
+
+static void report(sim_time_t elapsed)
+{
+    bulk_stats_t s;
+    sim_usb_counters_t u;
+    bulk_read_stats(&s, false);
+    sim_usb_counters(&u);
+    fprintf(stderr, "m1k-sim: %.1fs control %llu (%llu stalled), bulk in %llu out %llu, "
+            "timeouts %llu, cancelled %llu, in overruns %lu, out underruns %lu\n",
+            elapsed / 1e9, (unsigned long long)u.control, (unsigned long long)u.stalled,
+            (unsigned long long)u.in_transfers, (unsigned long long)u.out_transfers,
+            (unsigned long long)u.timeouts, (unsigned long long)u.cancelled,
+            (unsigned long)s.in_overruns, (unsigned long)s.out_underruns);
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: m1k-sim [options]\n"
+            "  -s path    socket, default $" SIM_SOCKET_ENV " or " SIM_SOCKET_DEFAULT "\n"
+            "  -b n       bulk bandwidth in bytes/us, default 40\n"
+            "  -j us      random delay before each host transfer is serviced\n"
+            "  -S ms      host stops servicing transfers for this long...\n"
+            "  -e ms      ...this often\n"
+            "  -f path    keep flash, and so calibration, in this file\n"
+            "  -v         print counters every second\n");
+    exit(1);
+}
+
+int main(int argc, char ** argv)
+{
+    const char * path = getenv(SIM_SOCKET_ENV);
+    sim_usb_faults_t faults = {.bytes_per_us = 40};
+    int opt;
+
+    if (!path)
+        path = SIM_SOCKET_DEFAULT;
+    while ((opt = getopt(argc, argv, "s:b:j:S:e:f:v")) != -1) {
+        switch (opt) {
+        case 's': path = optarg; break;
+        case 'b': faults.bytes_per_us = atoi(optarg); break;
+        case 'j': faults.jitter_us = atoi(optarg); break;
+        case 'S': faults.stall_us = atoi(optarg) * 1000; break;
+        case 'e': faults.stall_every_us = atoi(optarg) * 1000; break;
+        case 'f':
+            if (!sim_flash_open(optarg)) {
+                fprintf(stderr, "m1k-sim: %s is not a flash image\n", optarg);
+                return 1;
+            }
+            break;
+        case 'v': verbose = true; break;
+        default: usage();
+        }
+    }
+
+    // The firmware keeps 32-bit addresses in PDC registers and its DMA table
+    if ((uintptr_t)&sim_now > UINT32_MAX) {
+        fprintf(stderr, "m1k-sim: must be linked without PIE\n");
+        return 1;
+    }
+
+    int listen_fd = listen_on(path);
+    if (listen_fd < 0)
+        return 1;
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    sim_usb_init(&faults);
+    profile_init();
+    power_monitor_init();
+    calibration_init();
+    fprintf(stderr, "m1k-sim: listening on %s\n", path);
+
+    const sim_time_t epoch = wall_ns();
+    sim_time_t next_sof = SIM_MICROFRAME_NS;
+    sim_time_t next_report = 1000000000;
+    int host_fd = -1;
+
+    while (!quit) {
+        // Catch simulated time up with the wall clock, one event at a time:
+        // timer interrupts and SOFs in order, with the bus, the pended bulk
+        // interrupt and the main loop run after each as the firmware would
+        // between interrupts.
+        sim_time_t wall = wall_ns() - epoch;
+        for (;;) {
+            sim_time_t next = Min(sim_timer_next(), next_sof);
+            if (next > wall)
+                break;
+            sim_now = next;
+            if (next == next_sof) {
+                sim_sof();
+                next_sof += SIM_MICROFRAME_NS;
+            }
+            else {
+                sim_timer_interrupt();
+            }
+            sim_usb_service();
+            sim_pending_irqs();
+            iap_poll();
+        }
+        if (verbose && sim_now >= next_report) {
+            report(sim_now);
+            next_report += 1000000000;
+        }
+
+        // Sleep until the next event, or until the host has something
+        struct pollfd pfd = {.fd = host_fd >= 0 ? host_fd : listen_fd, .events = POLLIN};
+        sim_time_t wait = Min(sim_timer_next(), next_sof) - wall;
+        struct timespec ts = {wait / 1000000000, wait % 1000000000};
+        if (ppoll(&pfd, 1, &ts, NULL) <= 0)
+            continue;
+        if (host_fd < 0) {
+            host_fd = accept(listen_fd, NULL, NULL);
+            sim_usb_attach(host_fd);
+            if (verbose)
+                fprintf(stderr, "m1k-sim: host connected\n");
+            continue;
+        }
+        // drain everything the host has queued before simulating further
+        do {
+            if (!read_message(host_fd)) {
+                close(host_fd);
+                host_fd = -1;
+                sim_usb_attach(-1);
+                if (verbose)
+                    fprintf(stderr, "m1k-sim: host disconnected\n");
+                break;
+            }
+            pfd.revents = 0;
+        } while (poll(&pfd, 1, 0) > 0);
+        sim_usb_service();
+        sim_pending_irqs();
+    }
+
+    report(sim_now);
+    unlink(path);
+    return 0;
+}
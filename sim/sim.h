@@ -0,0 +1,77 @@
+#ifndef _SIM_H_
+#define _SIM_H_
+
+#include <asf.h>
+#include "sim_proto.h"
+
+/// Simulated time in nanoseconds. It follows the wall clock while the
+/// simulator keeps up, and every event is stamped with its ideal time.
+typedef uint64_t sim_time_t;
+
+extern sim_time_t sim_now;
+
+// MCK/2, the TC0 channel 2 clock (TIMER_CLOCK1)
+#define SIM_TC_HZ               48000000
+#define SIM_MICROFRAME_NS       125000
+
+// Entry points into the firmware that ASF or the vector table would call
+void TC2_Handler(void);
+void TWI0_Handler(void);
+void USART0_Handler(void);
+void HSMCI_Handler(void);
+
+// *************************************************************************************************
+// sim_hw.c: registers, PDC and the device under test
+// *************************************************************************************************
+
+/// Time of the next TC2 interrupt, or UINT64_MAX while the timer is stopped
+sim_time_t sim_timer_next(void);
+
+/// Run TC2_Handler, then the PDC transfers it started
+void sim_timer_interrupt(void);
+
+/// Advance the USB microframe counter and call the SOF hook
+void sim_sof(void);
+
+/// Run software interrupts the firmware pended, as the NVIC would once the
+/// handler that pended them returns
+void sim_pending_irqs(void);
+
+/// Keep flash in `path`: load it now if it exists, rewrite it after each
+/// write. Without this flash starts erased and lasts as long as the process.
+bool sim_flash_open(const char * path);
+
+// *************************************************************************************************
+// sim_usb.c: control and bulk endpoints, matched against the host's transfers
+// *************************************************************************************************
+
+typedef struct {
+    uint32_t bytes_per_us;      // bulk bandwidth shared by both endpoints
+    uint32_t stall_every_us;    // host stops servicing the device this often...
+    uint32_t stall_us;          // ...for this long
+    uint32_t jitter_us;         // extra random delay on each host transfer
+} sim_usb_faults_t;
+
+typedef struct {
+    uint64_t control;
+    uint64_t stalled;
+    uint64_t in_transfers;
+    uint64_t out_transfers;
+    uint64_t timeouts;
+    uint64_t cancelled;
+} sim_usb_counters_t;
+
+void sim_usb_init(const sim_usb_faults_t * faults);
+
+/// Host connected on `fd`, or disconnected when fd < 0
+void sim_usb_attach(int fd);
+
+/// Handle one message from the host; `data` holds its payload
+void sim_usb_message(const sim_msg_t * msg, const uint8_t * data);
+
+/// Start and finish bulk transfers that are due at sim_now
+void sim_usb_service(void);
+
+void sim_usb_counters(sim_usb_counters_t * out);
+
+#endif // _SIM_H_
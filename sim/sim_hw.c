@@ -0,0 +1,403 @@
+#include "sim.h"
+#include "main.h"
+#include "init.h"
+#include "board_io.h"
+#include "conf_usb.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Peripherals as the firmware sees them. Only the registers it touches are
+// modelled: TC0 channel 2 paces the simulation, the PDC fields of the three
+// USARTs are played out after each interrupt, DAC command frames from the
+// main loop go out as soon as they start, PIOA/PIOB hold pin state and TWI0
+// answers for the pots and the hotswap controller.
+
+// THR when the firmware hasn't written a byte since the model took the last
+#define TWI_THR_EMPTY   0xFFFFFFFF
+
+Tc sim_tc0;
+Usart sim_usart0 = {.US_CSR = US_CSR_TXEMPTY};
+Usart sim_usart1, sim_usart2;
+Pio sim_pioa, sim_piob;
+Udphs sim_udphs;
+Twi sim_twi0 = {.TWI_THR = TWI_THR_EMPTY};
+Wdt sim_wdt;
+// nothing advances CYCCNT, so PROFILE=1 builds record zero-cycle samples
+CoreDebug_Type sim_coredebug;
+DWT_Type sim_dwt;
+
+uint8_t serial_number[USB_DEVICE_GET_SERIAL_NAME_LENGTH];
+
+static bool timer_running;
+static sim_time_t timer_next;
+static uint32_t microframe;
+
+// Device under test: each channel's DAC drives its own voltage ADC directly
+// and a fixed load, so V reads back the DAC code and I follows it at a
+// quarter of the swing, plus a little deterministic noise.
+static uint16_t dac[2] = {0x8000, 0x8000};
+static uint32_t noise = 1;
+
+static uint16_t dut_sample(uint8_t chan, bool current)
+{
+    noise = noise * 1103515245 + 12345;
+    int32_t v = dac[chan];
+    if (current)
+        v = 0x8000 + (v - 0x8000) / 4;
+    v += (int32_t)((noise >> 16) & 3) - 1;
+    return Max(0, Min(0xFFFF, v));
+}
+
+static inline void * pdc_ptr(uint32_t addr)
+{
+    return (void *)(uintptr_t)addr;
+}
+
+/// One ADC conversion: the configuration word on TPR selects V or I, and the
+/// big-endian result lands on RPR as the SPI USART would write it.
+static void pdc_adc(Usart * u, uint8_t chan)
+{
+    if (!u->US_RCR)
+        return;
+    const uint8_t * conf = pdc_ptr(u->US_TPR);
+    // SEQ bits are set in the current ADC configuration, see bulk_sampling.c
+    bool current = (conf[0] & 0x06) != 0;
+    uint16_t code = dut_sample(chan, current);
+    uint8_t * rx = pdc_ptr(u->US_RPR);
+    rx[0] = code >> 8;
+    rx[1] = code & 0xFF;
+    u->US_RPR += 2;
+    u->US_TPR += 2;
+    u->US_RCR = u->US_TCR = 0;
+}
+
+/// One AD5663 frame on USART0: the command byte, then the data word.
+/// Writes to input register A or B set that channel; the reference and
+/// power-down commands change nothing here.
+static void pdc_dac(void)
+{
+    Usart * u = USART0;
+    uint8_t command = *(uint8_t *)pdc_ptr(u->US_TPR);
+    uint8_t op = (command >> 3) & 7;
+    uint8_t addr = command & 7;
+    const uint8_t * w = pdc_ptr(u->US_TNPR);
+    if (u->US_TNCR == 2 && (op == 0 || op == 2 || op == 3) && addr <= B)
+        dac[addr] = w[0] << 8 | w[1];
+    u->US_TCR = u->US_TNCR = 0;
+}
+
+/// Play out the transfers set up by the handler: the channel's DAC frame,
+/// then one conversion on each ADC.
+static void pdc_run(void)
+{
+    Usart * u = USART0;
+    if (!u->US_TCR)
+        return;
+    uint8_t chan = *(uint8_t *)pdc_ptr(u->US_TPR) & 1;
+    pdc_dac();
+    pdc_adc(USART1, chan);
+    pdc_adc(USART2, chan);
+}
+
+/// Take USART0 interrupts while TXEMPTY is enabled, playing out each DAC
+/// frame dac_queue.c starts. Every place the firmware writes both IDR and
+/// IER disables before it enables.
+static void usart0_run(void)
+{
+    static bool running;
+    Usart * u = USART0;
+    if (running)
+        return;
+    running = true;
+    for (;;) {
+        u->US_IMR = (u->US_IMR & ~u->US_IDR) | u->US_IER;
+        u->US_IDR = u->US_IER = 0;
+        if (u->US_TCR)
+            pdc_dac();
+        if (!(u->US_IMR & US_CSR_TXEMPTY))
+            break;
+        USART0_Handler();
+    }
+    running = false;
+}
+
+// TWI0: each transaction runs to completion as soon as it is started, with
+// TWI0_Handler called for every flag it enables, as if the bus were
+// infinitely fast. Reads from the ADM1177 return a fixed reading:
+// V[11:4], I[11:4], V[3:0]:I[3:0], with V about 5V on the 6.65V range.
+static const uint8_t adm1177_reading[3] = {0xC0, 0x10, 0x70};
+
+static enum { TWI_IDLE, TWI_WRITE, TWI_READ } twi_state;
+static uint8_t twi_count;
+static bool twi_last;
+static bool twi_running;
+
+static bool twi_chip_present(uint8_t chip)
+{
+    return chip == 0x2f || chip == 0x23 || chip == 0x58;
+}
+
+/// Advance the bus on what the firmware has written since the last step
+static void twi_step(void)
+{
+    Twi * t = TWI0;
+    uint32_t cr = t->TWI_CR;
+    uint8_t chip = (t->TWI_MMR >> 16) & 0x7f;
+    t->TWI_CR = 0;
+    // every place the firmware writes both disables before it enables
+    t->TWI_IMR = (t->TWI_IMR & ~t->TWI_IDR) | t->TWI_IER;
+    t->TWI_IDR = t->TWI_IER = 0;
+
+    if (twi_state == TWI_IDLE) {
+        bool read = t->TWI_MMR & TWI_MMR_MREAD;
+        if (read ? (cr & TWI_CR_START) : (t->TWI_THR != TWI_THR_EMPTY)) {
+            t->TWI_SR &= ~TWI_SR_TXCOMP;
+            twi_count = 0;
+            twi_last = false;
+            if (!twi_chip_present(chip)) {
+                t->TWI_THR = TWI_THR_EMPTY;
+                t->TWI_SR |= TWI_SR_NACK | TWI_SR_TXCOMP;
+                return;
+            }
+            twi_state = read ? TWI_READ : TWI_WRITE;
+        }
+    }
+    if (twi_state == TWI_WRITE) {
+        t->TWI_THR = TWI_THR_EMPTY;
+        t->TWI_SR |= TWI_SR_TXRDY;
+        if (cr & TWI_CR_STOP) {
+            t->TWI_SR |= TWI_SR_TXCOMP;
+            twi_state = TWI_IDLE;
+        }
+    }
+    else if (twi_state == TWI_READ && !(t->TWI_SR & TWI_SR_RXRDY)) {
+        if (twi_last) {
+            t->TWI_SR |= TWI_SR_TXCOMP;
+            twi_state = TWI_IDLE;
+            return;
+        }
+        // a STOP requested before this byte arrives makes it the last
+        twi_last = (cr & TWI_CR_STOP) != 0;
+        t->TWI_RHR = (chip == 0x58 && twi_count < sizeof(adm1177_reading)) ? adm1177_reading[twi_count] : 0;
+        twi_count++;
+        t->TWI_SR |= TWI_SR_RXRDY;
+    }
+}
+
+/// Take TWI interrupts until the bus goes quiet. Called wherever the
+/// firmware unmasks interrupts, so a transaction queued from the main loop
+/// or a control request is done by the time it looks.
+static void twi_run(void)
+{
+    Twi * t = TWI0;
+    if (twi_running)
+        return;
+    twi_running = true;
+    for (;;) {
+        twi_step();
+        uint32_t pending = t->TWI_SR & t->TWI_IMR;
+        if (!pending)
+            break;
+        TWI0_Handler();
+        // the handler has read RHR, and reading SR cleared NACK
+        t->TWI_SR &= ~(TWI_SR_NACK | (pending & TWI_SR_RXRDY));
+    }
+    twi_running = false;
+}
+
+static sim_time_t timer_period_ns(void)
+{
+    uint32_t rc = TC0->TC_CHANNEL[2].TC_RC;
+    return (sim_time_t)Max(rc, 2) * 1000000000 / SIM_TC_HZ;
+}
+
+sim_time_t sim_timer_next(void)
+{
+    return timer_running ? timer_next : UINT64_MAX;
+}
+
+void sim_timer_interrupt(void)
+{
+    TcChannel * tc = &TC0->TC_CHANNEL[2];
+    tc->TC_CV = 0;
+    TC2_Handler();
+    pdc_run();
+    usart0_run();
+    // pins driven through PIO_ODSR, as masked by PIO_OWSR
+    uint32_t written = PIOA->PIO_OWSR & PIOA->PIO_OSR;
+    PIOA->PIO_PDSR = (PIOA->PIO_PDSR & ~written) | (PIOA->PIO_ODSR & written);
+    timer_next += timer_period_ns();
+    if (tc->TC_CCR & TC_CCR_CLKDIS)
+        timer_running = false;
+    tc->TC_CCR = 0;
+}
+
+void sim_sof(void)
+{
+    microframe++;
+    UDPHS->UDPHS_FNUM = ((microframe >> 3) << 3 & UDPHS_FNUM_FRAME_NUMBER_Msk)
+                        | (microframe & UDPHS_FNUM_MICRO_FRAME_NUM_Msk);
+    main_sof_action();
+}
+
+// *************************************************************************************************
+// ASF drivers
+// *************************************************************************************************
+
+void tc_start(Tc * tc, uint32_t ch)
+{
+    timer_running = true;
+    timer_next = sim_now + timer_period_ns();
+}
+
+void tc_stop(Tc * tc, uint32_t ch)
+{
+    timer_running = false;
+}
+
+void tc_write_ra(Tc * tc, uint32_t ch, uint32_t v) { tc->TC_CHANNEL[ch].TC_RA = v; }
+void tc_write_rb(Tc * tc, uint32_t ch, uint32_t v) { tc->TC_CHANNEL[ch].TC_RB = v; }
+void tc_write_rc(Tc * tc, uint32_t ch, uint32_t v) { tc->TC_CHANNEL[ch].TC_RC = v; }
+void tc_init(Tc * tc, uint32_t ch, uint32_t mode) { tc->TC_CHANNEL[ch].TC_CMR = mode; }
+void tc_enable_interrupt(Tc * tc, uint32_t ch, uint32_t sources) { tc->TC_CHANNEL[ch].TC_IER = sources; }
+
+void pio_set(Pio * p, uint32_t mask) { p->PIO_ODSR |= mask; p->PIO_PDSR |= mask & p->PIO_OSR; }
+void pio_clear(Pio * p, uint32_t mask) { p->PIO_ODSR &= ~mask; p->PIO_PDSR &= ~(mask & p->PIO_OSR); }
+
+void pio_set_output(Pio * p, uint32_t mask, uint32_t level, uint32_t open_drain, uint32_t pull_up)
+{
+    p->PIO_OSR |= mask;
+    if (level)
+        pio_set(p, mask);
+    else
+        pio_clear(p, mask);
+}
+
+void pio_set_input(Pio * p, uint32_t mask, uint32_t attribute)
+{
+    p->PIO_OSR &= ~mask;
+}
+
+void pio_enable_output_write(Pio * p, uint32_t mask) { p->PIO_OWSR |= mask; }
+void pio_disable_output_write(Pio * p, uint32_t mask) { p->PIO_OWSR &= ~mask; }
+
+uint32_t pio_get_pin_value(uint32_t pin)
+{
+    Pio * p = (pin < 32) ? PIOA : PIOB;
+    return (p->PIO_PDSR >> (pin & 0x1F)) & 1;
+}
+
+// Flash is an array at a 32-bit address (no PIE), erased at startup and
+// optionally mirrored to a file so calibration survives a restart. Pages
+// written through EFC0 directly, as the firmware update's copy does, land
+// in the array without any command being needed, and are saved at reset.
+uint8_t sim_flash[IFLASH0_SIZE] = {[0 ... IFLASH0_SIZE-1] = 0xFF};
+Efc sim_efc0 = {.EEFC_FSR = EEFC_FSR_FRDY};
+static const char * flash_path;
+static bool boot_rom;           // GPNVM bit 1 clear
+
+static void flash_save(void)
+{
+    if (!flash_path)
+        return;
+    FILE * f = fopen(flash_path, "wb");
+    if (f) {
+        fwrite(sim_flash, 1, sizeof(sim_flash), f);
+        fclose(f);
+    }
+}
+
+uint32_t flash_clear_gpnvm(uint32_t gpnvm) { boot_rom |= (gpnvm == 1); return 0; }
+uint32_t flash_set_gpnvm(uint32_t gpnvm) { boot_rom &= (gpnvm != 1); return 0; }
+
+/// The simulator stops rather than rebooting; run it again with the same -f.
+void NVIC_SystemReset(void)
+{
+    // the last command the firmware gave EFC0 itself
+    if (EFC0->EEFC_FCR == (EEFC_FCR_FKEY(0x5A) | EEFC_FCR_FARG(1) | EEFC_FCR_FCMD(EFC_FCMD_SGPB)))
+        boot_rom = false;
+    flash_save();
+    fprintf(stderr, "m1k-sim: reset, booting from %s\n", boot_rom ? "the SAM-BA ROM" : "flash");
+    exit(0);
+}
+
+bool sim_flash_open(const char * path)
+{
+    flash_path = path;
+    FILE * f = fopen(path, "rb");
+    if (!f)
+        return true;
+    bool ok = fread(sim_flash, 1, sizeof(sim_flash), f) == sizeof(sim_flash);
+    fclose(f);
+    return ok;
+}
+
+uint32_t flash_unlock(uint32_t start, uint32_t end, uint32_t * actual_start, uint32_t * actual_end)
+{
+    return FLASH_RC_OK;
+}
+
+uint32_t flash_write(uint32_t addr, const void * buffer, uint32_t size, uint32_t erase)
+{
+    if ((addr < IFLASH0_ADDR) || (addr + size > IFLASH0_ADDR + IFLASH0_SIZE))
+        return FLASH_RC_INVALID;
+    // as ASF does: the rest of each page is kept, written bits can only clear without erase
+    uint8_t * p = &sim_flash[addr - IFLASH0_ADDR];
+    const uint8_t * d = buffer;
+    for (uint32_t i = 0; i < size; i++)
+        p[i] = erase ? d[i] : (p[i] & d[i]);
+    flash_save();
+    return FLASH_RC_OK;
+}
+
+// The simulator is single threaded, so interrupts can't preempt anything;
+// TWI and USART0 interrupts are taken when the firmware unmasks them, and
+// the pended HSMCI one (BULK_IRQn) by the event loop between events.
+static bool hsmci_pending;
+
+irqflags_t cpu_irq_save(void) { return 0; }
+void cpu_irq_restore(irqflags_t flags) { twi_run(); usart0_run(); }
+void NVIC_SetPriority(IRQn_Type irq, uint32_t priority) { }
+void NVIC_EnableIRQ(IRQn_Type irq) { }
+// nothing preempts BULK_Handler here, so masking UDPHS changes nothing
+uint32_t __get_BASEPRI(void) { return 0; }
+void __set_BASEPRI(uint32_t basepri) { }
+void NVIC_SetPendingIRQ(IRQn_Type irq)
+{
+    if (irq == HSMCI_IRQn)
+        hsmci_pending = true;
+}
+
+void sim_pending_irqs(void)
+{
+    // cleared before the handler runs, so it can pend itself again
+    while (hsmci_pending) {
+        hsmci_pending = false;
+        HSMCI_Handler();
+    }
+}
+
+// the event loop is the simulator's idle
+void sleepmgr_init(void) { }
+void sleepmgr_enter_sleep(void) { }
+void sleepmgr_lock_mode(enum sleepmgr_mode mode) { }
+void sleepmgr_unlock_mode(enum sleepmgr_mode mode) { }
+void cpu_irq_enable(void) { }
+void cpu_irq_disable(void) { }
+void irq_initialize_vectors(void) { }
+void sysclk_init(void) { }
+void cpu_delay_us(uint32_t us, uint32_t hz) { }
+void wdt_init(Wdt * wdt, uint32_t mode, uint16_t counter, uint16_t delta) { }
+void wdt_restart(Wdt * wdt) { }
+void udc_detach(void) { }
+void udc_stop(void) { }
+void udc_start(void) { }
+void udc_attach(void) { }
+
+// *************************************************************************************************
+// init.c, which only configures hardware the simulator doesn't model
+// *************************************************************************************************
+
+void init_build_usb_serial_number(void) { }
+void init_hardware(void) { }
@@ -0,0 +1,52 @@
+#ifndef _SIM_PROTO_H_
+#define _SIM_PROTO_H_
+
+// Wire protocol between the simulator and its libusb shim, over a Unix
+// stream socket. Every message is a sim_msg_t followed by `length` bytes of
+// data: OUT data for requests, IN data for replies. Both ends run on the same
+// machine, so fields are in host byte order.
+
+#include <stdint.h>
+
+#define SIM_SOCKET_ENV      "M1K_SIM_SOCKET"
+#define SIM_SOCKET_DEFAULT  "/tmp/m1k-sim.sock"
+
+enum sim_msg_type {
+    // shim -> simulator
+    SIM_CONTROL = 1,        // setup packet, OUT data stage follows
+    SIM_SET_ALT,            // select the alternate setting in `value`
+    SIM_BULK_SUBMIT,        // queue a transfer on `endpoint`, OUT data follows
+    SIM_BULK_CANCEL,        // cancel transfer `id`
+    // simulator -> shim
+    SIM_CONTROL_DONE,       // `status` bytes transferred or SIM_STALL, IN data follows
+    SIM_BULK_DONE,          // `status` a SIM_XFER_* code, IN data follows
+};
+
+// SIM_CONTROL_DONE status for a stalled request
+#define SIM_STALL           (-9)
+
+// SIM_BULK_DONE status, numbered as libusb_transfer_status
+enum sim_xfer_status {
+    SIM_XFER_COMPLETED = 0,
+    SIM_XFER_ERROR,
+    SIM_XFER_TIMED_OUT,
+    SIM_XFER_CANCELLED,
+};
+
+typedef struct {
+    uint32_t type;
+    uint32_t length;        // data bytes following this header
+    uint64_t id;            // transfer id, echoed in the reply
+    int32_t status;
+    uint32_t timeout_ms;    // 0 to wait forever
+    uint32_t xfer_length;   // bulk: bytes requested, or in replies transferred
+    uint8_t bmRequestType;
+    uint8_t bRequest;
+    uint16_t value;
+    uint16_t index;
+    uint16_t wLength;
+    uint8_t endpoint;
+    uint8_t pad[1];
+} sim_msg_t;
+
+#endif // _SIM_PROTO_H_
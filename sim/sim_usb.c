@@ -0,0 +1,306 @@
+#include "sim.h"
+#include "main.h"
+#include "bulk_sampling.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// USB device side of the simulator. The firmware's udd/udi calls arm one
+// transfer per bulk endpoint, the host's transfers arrive from the shim, and
+// a transfer completes once both sides are ready and the bus has carried it.
+// Fault injection works on the host side: during a stall window, or until a
+// transfer's jitter has passed, the host is not polling the endpoint.
+
+udd_ctrl_request_t udd_g_ctrlreq;
+
+typedef struct host_xfer {
+    struct host_xfer * next;
+    uint64_t id;
+    uint32_t length;
+    sim_time_t ready;           // arrival plus injected jitter
+    sim_time_t deadline;        // UINT64_MAX without a timeout
+    uint8_t data[];             // OUT data
+} host_xfer_t;
+
+typedef struct {
+    uint8_t ep;
+    // armed by udi_vendor_bulk_*_run
+    uint8_t * buf;
+    iram_size_t size;
+    udd_callback_trans_t callback;
+    // queued by the host, oldest first
+    host_xfer_t * head;
+    host_xfer_t ** tail;
+    // the head transfer is on the bus until `done`
+    bool busy;
+    sim_time_t done;
+} endpoint_t;
+
+static endpoint_t ep_in = {.ep = UDI_VENDOR_EP_BULK_IN};
+static endpoint_t ep_out = {.ep = UDI_VENDOR_EP_BULK_OUT};
+
+static sim_usb_faults_t faults;
+static sim_usb_counters_t counters;
+static int host_fd = -1;
+static sim_time_t bus_free;
+
+static void send_msg(sim_msg_t * msg, const void * data, uint32_t length)
+{
+    if (host_fd < 0)
+        return;
+    msg->length = length;
+    if (write(host_fd, msg, sizeof(*msg)) != sizeof(*msg) ||
+        (length && write(host_fd, data, length) != (ssize_t)length)) {
+        perror("m1k-sim: write");
+    }
+}
+
+static void send_bulk_done(host_xfer_t * x, int32_t status, const void * data, uint32_t actual)
+{
+    sim_msg_t msg = {.type = SIM_BULK_DONE, .id = x->id, .status = status, .xfer_length = actual};
+    send_msg(&msg, data, data ? actual : 0);
+}
+
+static endpoint_t * endpoint(uint8_t ep)
+{
+    if (ep == UDI_VENDOR_EP_BULK_IN)
+        return &ep_in;
+    if (ep == UDI_VENDOR_EP_BULK_OUT)
+        return &ep_out;
+    return NULL;
+}
+
+static host_xfer_t * pop_head(endpoint_t * e)
+{
+    host_xfer_t * x = e->head;
+    e->head = x->next;
+    if (!e->head)
+        e->tail = &e->head;
+    e->busy = false;
+    return x;
+}
+
+static bool run(endpoint_t * e, uint8_t * buf, iram_size_t size, udd_callback_trans_t callback)
+{
+    if (e->callback)
+        return false;
+    e->buf = buf;
+    e->size = size;
+    e->callback = callback;
+    return true;
+}
+
+bool udi_vendor_bulk_in_run(uint8_t * buf, iram_size_t size, udd_callback_trans_t callback)
+{
+    return run(&ep_in, buf, size, callback);
+}
+
+bool udi_vendor_bulk_out_run(uint8_t * buf, iram_size_t size, udd_callback_trans_t callback)
+{
+    return run(&ep_out, buf, size, callback);
+}
+
+void udd_ep_abort(udd_ep_id_t ep)
+{
+    endpoint_t * e = endpoint(ep);
+    if (!e || !e->callback)
+        return;
+    udd_callback_trans_t callback = e->callback;
+    e->callback = NULL;
+    // the host's transfer stays queued for whatever is armed next
+    e->busy = false;
+    callback(UDD_EP_TRANSFER_ABORT, 0, ep);
+}
+
+/// The endpoint's transfer finished on the bus: hand the data across and
+/// complete both sides.
+static void complete(endpoint_t * e)
+{
+    host_xfer_t * x = pop_head(e);
+    uint32_t n = Min(x->length, e->size);
+    udd_callback_trans_t callback = e->callback;
+    e->callback = NULL;
+    if (e->ep == UDI_VENDOR_EP_BULK_IN) {
+        send_bulk_done(x, SIM_XFER_COMPLETED, e->buf, n);
+        counters.in_transfers++;
+    }
+    else {
+        memcpy(e->buf, x->data, n);
+        send_bulk_done(x, SIM_XFER_COMPLETED, NULL, n);
+        counters.out_transfers++;
+    }
+    free(x);
+    callback(UDD_EP_TRANSFER_OK, n, e->ep);
+}
+
+static bool host_stalled(void)
+{
+    if (!faults.stall_every_us || !faults.stall_us)
+        return false;
+    return (sim_now / 1000) % faults.stall_every_us < faults.stall_us;
+}
+
+static void service(endpoint_t * e)
+{
+    // host transfers that timed out before the device got to them
+    while (e->head && !e->busy && e->head->deadline <= sim_now) {
+        host_xfer_t * x = pop_head(e);
+        send_bulk_done(x, SIM_XFER_TIMED_OUT, NULL, 0);
+        counters.timeouts++;
+        free(x);
+    }
+    if (e->busy && sim_now >= e->done) {
+        complete(e);
+    }
+    if (!e->busy && e->callback && e->head && e->head->ready <= sim_now && !host_stalled()) {
+        uint32_t n = Min(e->head->length, e->size);
+        sim_time_t start = Max(sim_now, bus_free);
+        e->busy = true;
+        e->done = start + (sim_time_t)n * 1000 / faults.bytes_per_us;
+        bus_free = e->done;
+    }
+}
+
+void sim_usb_service(void)
+{
+    service(&ep_in);
+    service(&ep_out);
+}
+
+// *************************************************************************************************
+// Host messages
+// *************************************************************************************************
+
+static void control(const sim_msg_t * msg, const uint8_t * data)
+{
+    sim_msg_t reply = {.type = SIM_CONTROL_DONE, .id = msg->id};
+
+    memset(&udd_g_ctrlreq, 0, sizeof(udd_g_ctrlreq));
+    udd_g_ctrlreq.req.bmRequestType = msg->bmRequestType;
+    udd_g_ctrlreq.req.bRequest = msg->bRequest;
+    udd_g_ctrlreq.req.wValue = msg->value;
+    udd_g_ctrlreq.req.wIndex = msg->index;
+    udd_g_ctrlreq.req.wLength = msg->wLength;
+    counters.control++;
+
+    if (!main_setup_handle()) {
+        reply.status = SIM_STALL;
+        counters.stalled++;
+        send_msg(&reply, NULL, 0);
+        return;
+    }
+
+    uint16_t n = Min(udd_g_ctrlreq.payload_size, msg->wLength);
+    if (Udd_setup_is_in()) {
+        reply.status = n;
+        send_msg(&reply, udd_g_ctrlreq.payload, n);
+    }
+    else {
+        // the data stage lands in the buffer the handler pointed us at
+        n = Min(n, msg->length);
+        if (n)
+            memcpy(udd_g_ctrlreq.payload, data, n);
+        reply.status = msg->wLength;
+        send_msg(&reply, NULL, 0);
+    }
+    if (udd_g_ctrlreq.callback)
+        udd_g_ctrlreq.callback();
+}
+
+static void submit(const sim_msg_t * msg, const uint8_t * data)
+{
+    endpoint_t * e = endpoint(msg->endpoint);
+    host_xfer_t * x = malloc(sizeof(*x) + msg->length);
+    x->next = NULL;
+    x->id = msg->id;
+    x->length = msg->xfer_length;
+    x->ready = sim_now;
+    if (faults.jitter_us)
+        x->ready += (sim_time_t)(rand() % faults.jitter_us) * 1000;
+    x->deadline = msg->timeout_ms ? sim_now + (sim_time_t)msg->timeout_ms * 1000000 : UINT64_MAX;
+    memcpy(x->data, data, msg->length);
+    if (!e) {
+        send_bulk_done(x, SIM_XFER_ERROR, NULL, 0);
+        free(x);
+        return;
+    }
+    *e->tail = x;
+    e->tail = &x->next;
+}
+
+static bool cancel_on(endpoint_t * e, uint64_t id)
+{
+    for (host_xfer_t ** p = &e->head; *p; p = &(*p)->next) {
+        host_xfer_t * x = *p;
+        if (x->id != id)
+            continue;
+        if (x == e->head)
+            e->busy = false;
+        *p = x->next;
+        if (e->tail == &x->next)
+            e->tail = p;
+        send_bulk_done(x, SIM_XFER_CANCELLED, NULL, 0);
+        counters.cancelled++;
+        free(x);
+        return true;
+    }
+    return false;
+}
+
+void sim_usb_message(const sim_msg_t * msg, const uint8_t * data)
+{
+    switch (msg->type) {
+    case SIM_CONTROL:
+        control(msg, data);
+        break;
+    case SIM_SET_ALT:
+        if (msg->value)
+            main_vendor_enable();
+        else
+            main_vendor_disable();
+        break;
+    case SIM_BULK_SUBMIT:
+        submit(msg, data);
+        break;
+    case SIM_BULK_CANCEL:
+        if (!cancel_on(&ep_in, msg->id))
+            cancel_on(&ep_out, msg->id);
+        break;
+    }
+}
+
+static void flush(endpoint_t * e)
+{
+    while (e->head)
+        free(pop_head(e));
+}
+
+void sim_usb_attach(int fd)
+{
+    host_fd = fd;
+    if (fd >= 0)
+        return;
+    // Unplugged: drop the host's transfers and stop streaming, as the
+    // bus reset on the next connection would.
+    flush(&ep_in);
+    flush(&ep_out);
+    config_bulk_sampling(0, 0);
+    udd_ep_abort(UDI_VENDOR_EP_BULK_IN);
+    udd_ep_abort(UDI_VENDOR_EP_BULK_OUT);
+    main_vendor_disable();
+}
+
+void sim_usb_init(const sim_usb_faults_t * f)
+{
+    faults = *f;
+    if (!faults.bytes_per_us)
+        faults.bytes_per_us = 1;
+    ep_in.tail = &ep_in.head;
+    ep_out.tail = &ep_out.head;
+}
+
+void sim_usb_counters(sim_usb_counters_t * out)
+{
+    *out = counters;
+}
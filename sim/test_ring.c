@@ -0,0 +1,161 @@
+// Host test of the sample ring cursors in src/bulk_ring.h.
+//
+// A producer and a consumer step through the ring in a pseudo-random
+// interleaving, as the sampling ISR and the bulk IN callbacks do, with the
+// free-running counts started just short of wrapping. Each chunk carries its
+// sequence number, so the consumer can check that it sees every published
+// chunk once and in order, and that the producer's drops account for the rest.
+// A triggered capture records round the ring unpublished, then hands over
+// its history; the consumer must get exactly the latest chunks, in order.
+//
+// usage: test_ring
+
+#include "bulk_ring.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define MAX_SLOTS   16
+#define STEPS       100000
+
+static int failures;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        failures++; \
+        fprintf(stderr, "test_ring: " __VA_ARGS__); \
+        fputc('\n', stderr); \
+    } \
+} while (0)
+
+/// Fill the ring without consuming anything: all but one slot is published,
+/// then every further chunk is dropped.
+static void test_full(uint8_t slots)
+{
+    ring_cursor_t prod, cons;
+    ring_reset(&prod);
+    ring_reset(&cons);
+    uint32_t published = 0, dropped = 0;
+    for (int i = 0; i < slots + 4; i++) {
+        if (ring_publish(&prod, &cons, slots))
+            published++;
+        else
+            dropped++;
+    }
+    CHECK(published == slots - 1u, "%u slots: %u published into an unread ring", slots, published);
+    CHECK(dropped == 5, "%u slots: %u dropped into an unread ring", slots, dropped);
+    CHECK(ring_pending(&prod, &cons) == slots - 1u, "%u slots: %u pending", slots, ring_pending(&prod, &cons));
+    // one chunk read frees exactly one slot
+    ring_advance(&cons, slots);
+    CHECK(ring_publish(&prod, &cons, slots), "%u slots: no room after a read", slots);
+    CHECK(!ring_publish(&prod, &cons, slots), "%u slots: room for two after a read", slots);
+}
+
+/// Producer and consumer at random rates, counts wrapping partway through.
+static void test_stream(uint8_t slots, uint32_t start, unsigned produce_odds)
+{
+    uint32_t contents[MAX_SLOTS];
+    ring_cursor_t prod, cons;
+    ring_reset(&prod);
+    ring_reset(&cons);
+    prod.count = cons.count = start;
+
+    uint32_t seq = 0, produced = 0, dropped = 0, received = 0;
+    uint32_t next_seen = 0;
+    bool seen_any = false;
+    for (int step = 0; step < STEPS; step++) {
+        if ((unsigned)rand() % 100 < produce_odds) {
+            contents[prod.slot] = seq++;
+            produced++;
+            if (!ring_publish(&prod, &cons, slots))
+                dropped++;
+        }
+        else if (ring_pending(&prod, &cons) > 0) {
+            uint32_t got = contents[cons.slot];
+            CHECK(!seen_any || got >= next_seen, "%u slots: chunk %u after %u", slots, got, next_seen - 1);
+            next_seen = got + 1;
+            seen_any = true;
+            received++;
+            ring_advance(&cons, slots);
+        }
+        CHECK(ring_pending(&prod, &cons) < slots, "%u slots: %u pending", slots, ring_pending(&prod, &cons));
+        if (failures)
+            return;
+    }
+    while (ring_pending(&prod, &cons) > 0) {
+        received++;
+        ring_advance(&cons, slots);
+    }
+    CHECK(received + dropped == produced, "%u slots: %u received + %u dropped of %u",
+          slots, received, dropped, produced);
+    CHECK(prod.count == start + received, "%u slots: count %u, expected %u",
+          slots, prod.count, start + received);
+    CHECK(prod.count < start, "%u slots: count never wrapped", slots);
+    CHECK(prod.slot == received % slots && cons.slot == prod.slot, "%u slots: slot %u/%u after %u chunks",
+          slots, prod.slot, cons.slot, received);
+}
+
+/// Record `armed` chunks round the ring unpublished, keeping up to `history`
+/// of them, then publish those and the trigger chunk and stream on.
+static void test_capture(uint8_t slots, uint32_t start, uint8_t history, unsigned armed)
+{
+    uint32_t contents[MAX_SLOTS];
+    ring_cursor_t prod, cons;
+    ring_reset(&prod);
+    ring_reset(&cons);
+    prod.count = cons.count = start;
+
+    uint32_t seq = 0;
+    uint8_t kept = 0;
+    for (unsigned i = 0; i < armed; i++) {
+        contents[prod.slot] = seq++;
+        ring_skip(&prod, slots);
+        if (kept < history)
+            kept++;
+        CHECK(ring_pending(&prod, &cons) == 0, "%u slots: published while armed", slots);
+    }
+    contents[prod.slot] = seq++;
+    ring_publish_history(&prod, &cons, slots, kept);
+    CHECK(ring_pending(&prod, &cons) == kept + 1u, "%u slots, %u of %u kept: %u pending",
+          slots, kept, armed, ring_pending(&prod, &cons));
+
+    // after the trigger chunk, the producer streams on as usual
+    uint32_t expect = seq - kept - 1;
+    for (int i = 0; i < 3*slots; i++) {
+        if (i % 2) {
+            contents[prod.slot] = seq++;
+            CHECK(ring_publish(&prod, &cons, slots), "%u slots: post-trigger chunk dropped", slots);
+        }
+        if (ring_pending(&prod, &cons) > 0) {
+            uint32_t got = contents[cons.slot];
+            CHECK(got == expect, "%u slots, %u of %u kept: chunk %u, expected %u",
+                  slots, kept, armed, got, expect);
+            expect = got + 1;
+            ring_advance(&cons, slots);
+        }
+        if (failures)
+            return;
+    }
+}
+
+int main(void)
+{
+    srand(1);
+    for (uint8_t slots = 2; slots <= MAX_SLOTS; slots++) {
+        test_full(slots);
+        // as arm_trigger() limits the history
+        for (uint8_t history = 0; history + 2 <= slots; history++) {
+            for (unsigned armed = 0; armed <= 2u*slots; armed++)
+                test_capture(slots, UINT32_MAX - 2, history, armed);
+        }
+        // consumer faster, matched, and slower than the producer
+        for (unsigned odds = 30; odds <= 70; odds += 20)
+            test_stream(slots, UINT32_MAX - STEPS/10, odds);
+    }
+    if (failures) {
+        fprintf(stderr, "test_ring: %d failures\n", failures);
+        return 1;
+    }
+    printf("test_ring: ok\n");
+    return 0;
+}
@@ -0,0 +1,17 @@
+#!/bin/sh
+# Run teststream against a private simulator instance with the host stalling
+# for 60ms every 500ms, so the device drops chunks and the gaps in sampleno
+# are checked. Extra arguments are passed to teststream.
+set -u
+cd "$(dirname "$0")"
+export M1K_SIM_SOCKET="${TMPDIR:-/tmp}/m1k-sim-test.$$"
+ARGS="${*:-480 2 256}"
+
+./m1k-sim -S 60 -e 500 &
+pid=$!
+while [ ! -S "$M1K_SIM_SOCKET" ]; do sleep 0.1; done
+../scripts/teststream $ARGS
+status=$?
+kill $pid
+wait $pid
+exit $status
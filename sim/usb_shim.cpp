@@ -0,0 +1,324 @@
+// libusb-1.0 shim for the firmware simulator.
+//
+// Implements the part of libusb the host tools use by forwarding control and
+// bulk transfers to m1k-sim over its socket. A reader thread collects the
+// replies: control transfers wake their caller directly, while bulk
+// completions queue until libusb_handle_events*() runs their callbacks, so
+// callers see the same threading as with the real library.
+
+#include <libusb-1.0/libusb.h>
+#include "sim_proto.h"
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+struct libusb_context {};
+
+struct libusb_device_handle {
+	int fd;
+};
+
+namespace {
+
+struct Completion {
+	libusb_transfer* transfer;
+	int status;
+	int actual;
+	std::vector<uint8_t> data;
+};
+
+struct ControlReply {
+	bool done;
+	int status;
+	std::vector<uint8_t> data;
+};
+
+struct Shim {
+	libusb_context ctx;
+	libusb_device_handle* handle = nullptr;
+	std::thread reader;
+	std::mutex write_mutex;
+
+	// guarded by mutex
+	std::mutex mutex;
+	std::condition_variable cv;
+	bool connected = false;
+	uint64_t next_id = 1;
+	std::map<uint64_t, libusb_transfer*> bulk;
+	std::map<libusb_transfer*, uint64_t> bulk_ids;
+	std::map<uint64_t, ControlReply*> controls;
+	std::deque<Completion> completions;
+};
+
+Shim shim;
+
+bool read_full(int fd, void* buf, size_t n) {
+	auto p = (uint8_t*) buf;
+	while (n) {
+		ssize_t r = read(fd, p, n);
+		if (r <= 0) return false;
+		p += r;
+		n -= r;
+	}
+	return true;
+}
+
+bool send(sim_msg_t& msg, const void* data, uint32_t length) {
+	std::lock_guard<std::mutex> lock(shim.write_mutex);
+	msg.length = length;
+	int fd = shim.handle->fd;
+	if (write(fd, &msg, sizeof(msg)) != sizeof(msg)) return false;
+	auto p = (const uint8_t*) data;
+	while (length) {
+		ssize_t r = write(fd, p, length);
+		if (r <= 0) return false;
+		p += r;
+		length -= r;
+	}
+	return true;
+}
+
+void read_replies(int fd) {
+	sim_msg_t msg;
+	std::vector<uint8_t> data;
+
+	while (read_full(fd, &msg, sizeof(msg))) {
+		data.resize(msg.length);
+		if (msg.length && !read_full(fd, &data[0], msg.length)) break;
+
+		std::lock_guard<std::mutex> lock(shim.mutex);
+		if (msg.type == SIM_CONTROL_DONE) {
+			auto it = shim.controls.find(msg.id);
+			if (it == shim.controls.end()) continue;	// timed out
+			it->second->done = true;
+			it->second->status = msg.status;
+			it->second->data.swap(data);
+			shim.controls.erase(it);
+		} else if (msg.type == SIM_BULK_DONE) {
+			auto it = shim.bulk.find(msg.id);
+			if (it == shim.bulk.end()) continue;
+			shim.bulk_ids.erase(it->second);
+			shim.completions.push_back(Completion{it->second, msg.status, (int) msg.xfer_length, data});
+			shim.bulk.erase(it);
+		}
+		shim.cv.notify_all();
+	}
+
+	// The simulator went away: fail everything still outstanding
+	std::lock_guard<std::mutex> lock(shim.mutex);
+	shim.connected = false;
+	for (auto& b: shim.bulk) {
+		shim.completions.push_back(Completion{b.second, LIBUSB_TRANSFER_NO_DEVICE, 0, {}});
+	}
+	shim.bulk.clear();
+	shim.bulk_ids.clear();
+	shim.cv.notify_all();
+}
+
+} // namespace
+
+extern "C" {
+
+int libusb_init(libusb_context** ctx) {
+	if (ctx) *ctx = &shim.ctx;
+	return 0;
+}
+
+void libusb_exit(libusb_context* ctx) {}
+
+void libusb_set_debug(libusb_context* ctx, int level) {}
+
+const char* libusb_error_name(int errcode) {
+	switch (errcode) {
+		case LIBUSB_SUCCESS: return "LIBUSB_SUCCESS";
+		case LIBUSB_ERROR_IO: return "LIBUSB_ERROR_IO";
+		case LIBUSB_ERROR_INVALID_PARAM: return "LIBUSB_ERROR_INVALID_PARAM";
+		case LIBUSB_ERROR_NO_DEVICE: return "LIBUSB_ERROR_NO_DEVICE";
+		case LIBUSB_ERROR_NOT_FOUND: return "LIBUSB_ERROR_NOT_FOUND";
+		case LIBUSB_ERROR_BUSY: return "LIBUSB_ERROR_BUSY";
+		case LIBUSB_ERROR_TIMEOUT: return "LIBUSB_ERROR_TIMEOUT";
+		case LIBUSB_ERROR_PIPE: return "LIBUSB_ERROR_PIPE";
+		case LIBUSB_ERROR_NO_MEM: return "LIBUSB_ERROR_NO_MEM";
+		case LIBUSB_ERROR_NOT_SUPPORTED: return "LIBUSB_ERROR_NOT_SUPPORTED";
+		default: return "LIBUSB_ERROR_OTHER";
+	}
+}
+
+/// Connects to the simulator named by $M1K_SIM_SOCKET; the ids are ignored,
+/// as it is the only device on its bus.
+libusb_device_handle* libusb_open_device_with_vid_pid(libusb_context* ctx,
+                                                      uint16_t vendor_id, uint16_t product_id) {
+	if (shim.handle) return nullptr;
+	const char* path = getenv(SIM_SOCKET_ENV);
+	if (!path) path = SIM_SOCKET_DEFAULT;
+
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) return nullptr;
+	if (connect(fd, (sockaddr*) &addr, sizeof(addr)) < 0) {
+		close(fd);
+		return nullptr;
+	}
+
+	shim.handle = new libusb_device_handle{fd};
+	shim.connected = true;
+	shim.reader = std::thread(read_replies, fd);
+	return shim.handle;
+}
+
+void libusb_close(libusb_device_handle* dev_handle) {
+	if (!dev_handle || dev_handle != shim.handle) return;
+	shutdown(dev_handle->fd, SHUT_RDWR);
+	shim.reader.join();
+	close(dev_handle->fd);
+	delete dev_handle;
+	shim.handle = nullptr;
+	shim.completions.clear();
+}
+
+int libusb_claim_interface(libusb_device_handle* dev_handle, int interface_number) {
+	return 0;
+}
+
+int libusb_release_interface(libusb_device_handle* dev_handle, int interface_number) {
+	return 0;
+}
+
+int libusb_set_interface_alt_setting(libusb_device_handle* dev_handle,
+                                     int interface_number, int alternate_setting) {
+	sim_msg_t msg = {};
+	msg.type = SIM_SET_ALT;
+	msg.value = alternate_setting;
+	return send(msg, nullptr, 0) ? 0 : LIBUSB_ERROR_NO_DEVICE;
+}
+
+int libusb_control_transfer(libusb_device_handle* dev_handle,
+                            uint8_t request_type, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                            unsigned char* data, uint16_t wLength, unsigned int timeout) {
+	const bool in = request_type & 0x80;
+	ControlReply reply = {false, 0, {}};
+	sim_msg_t msg = {};
+	msg.type = SIM_CONTROL;
+	msg.bmRequestType = request_type;
+	msg.bRequest = bRequest;
+	msg.value = wValue;
+	msg.index = wIndex;
+	msg.wLength = wLength;
+
+	std::unique_lock<std::mutex> lock(shim.mutex);
+	if (!shim.connected) return LIBUSB_ERROR_NO_DEVICE;
+	msg.id = shim.next_id++;
+	shim.controls[msg.id] = &reply;
+	lock.unlock();
+
+	if (!send(msg, data, in ? 0 : wLength)) {
+		lock.lock();
+		shim.controls.erase(msg.id);
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+
+	lock.lock();
+	auto done = [&]() { return reply.done || !shim.connected; };
+	if (timeout) {
+		shim.cv.wait_for(lock, std::chrono::milliseconds(timeout), done);
+	} else {
+		shim.cv.wait(lock, done);
+	}
+	if (!reply.done) {
+		shim.controls.erase(msg.id);
+		return shim.connected ? LIBUSB_ERROR_TIMEOUT : LIBUSB_ERROR_NO_DEVICE;
+	}
+	if (reply.status == SIM_STALL) return LIBUSB_ERROR_PIPE;
+	if (in) memcpy(data, reply.data.data(), reply.data.size());
+	return reply.status;
+}
+
+libusb_transfer* libusb_alloc_transfer(int iso_packets) {
+	return (libusb_transfer*) calloc(1, sizeof(libusb_transfer));
+}
+
+void libusb_free_transfer(libusb_transfer* transfer) {
+	if (!transfer) return;
+	if (transfer->flags & LIBUSB_TRANSFER_FREE_BUFFER) free(transfer->buffer);
+	free(transfer);
+}
+
+int libusb_submit_transfer(libusb_transfer* t) {
+	if (t->type != LIBUSB_TRANSFER_TYPE_BULK) return LIBUSB_ERROR_NOT_SUPPORTED;
+	const bool in = t->endpoint & 0x80;
+	sim_msg_t msg = {};
+	msg.type = SIM_BULK_SUBMIT;
+	msg.endpoint = t->endpoint;
+	msg.timeout_ms = t->timeout;
+	msg.xfer_length = t->length;
+
+	{
+		std::lock_guard<std::mutex> lock(shim.mutex);
+		if (!shim.connected) return LIBUSB_ERROR_NO_DEVICE;
+		if (shim.bulk_ids.count(t)) return LIBUSB_ERROR_BUSY;
+		msg.id = shim.next_id++;
+		shim.bulk[msg.id] = t;
+		shim.bulk_ids[t] = msg.id;
+	}
+	if (!send(msg, t->buffer, in ? 0 : t->length)) return LIBUSB_ERROR_NO_DEVICE;
+	return 0;
+}
+
+int libusb_cancel_transfer(libusb_transfer* t) {
+	sim_msg_t msg = {};
+	msg.type = SIM_BULK_CANCEL;
+	{
+		std::lock_guard<std::mutex> lock(shim.mutex);
+		auto it = shim.bulk_ids.find(t);
+		if (it == shim.bulk_ids.end()) return LIBUSB_ERROR_NOT_FOUND;
+		msg.id = it->second;
+	}
+	return send(msg, nullptr, 0) ? 0 : LIBUSB_ERROR_NO_DEVICE;
+}
+
+int libusb_handle_events_timeout_completed(libusb_context* ctx, timeval* tv, int* completed) {
+	std::deque<Completion> ready;
+	{
+		std::unique_lock<std::mutex> lock(shim.mutex);
+		auto pending = [&]() { return !shim.completions.empty() || (completed && *completed); };
+		if (tv) {
+			auto wait = std::chrono::seconds(tv->tv_sec) + std::chrono::microseconds(tv->tv_usec);
+			shim.cv.wait_for(lock, wait, pending);
+		} else {
+			shim.cv.wait_for(lock, std::chrono::seconds(60), pending);
+		}
+		ready.swap(shim.completions);
+	}
+
+	for (auto& c: ready) {
+		libusb_transfer* t = c.transfer;
+		t->status = (libusb_transfer_status) c.status;
+		t->actual_length = c.actual;
+		if (!c.data.empty()) memcpy(t->buffer, c.data.data(), std::min<size_t>(c.data.size(), t->length));
+		t->callback(t);
+	}
+	return 0;
+}
+
+int libusb_handle_events_timeout(libusb_context* ctx, timeval* tv) {
+	return libusb_handle_events_timeout_completed(ctx, tv, nullptr);
+}
+
+int libusb_handle_events(libusb_context* ctx) {
+	return libusb_handle_events_timeout_completed(ctx, nullptr, nullptr);
+}
+
+} // extern "C"
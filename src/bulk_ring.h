@@ -0,0 +1,69 @@
+#ifndef _BULK_RING_H_
+#define _BULK_RING_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/// One end of the sample buffer ring.
+/// Each cursor has one writer (the sampling ISR or a USB completion
+/// callback); the other side only ever reads `count`, so no locking is needed.
+/// The exception is ring_publish_history(), see there.
+/// Kept free of ASF dependencies so the ring can be exercised in a host build.
+typedef struct {
+    volatile uint32_t count; ///< chunks completed, free-running
+    uint8_t slot;            ///< slot holding the next chunk
+} ring_cursor_t;
+
+static inline void ring_reset(ring_cursor_t * c)
+{
+    c->slot = 0;
+    c->count = 0;
+}
+
+/// move a cursor on to the next slot, publishing the current one
+static inline void ring_advance(ring_cursor_t * c, uint8_t slots)
+{
+    c->slot = (c->slot + 1 == slots) ? 0 : c->slot + 1;
+    c->count++;
+}
+
+/// number of chunks published by `prod` that `cons` has not yet consumed
+static inline uint32_t ring_pending(const ring_cursor_t * prod, const ring_cursor_t * cons)
+{
+    return prod->count - cons->count;
+}
+
+/// Publish the producer's current chunk and move on, unless the next slot is
+/// still queued for the consumer: then false, and the chunk is dropped so
+/// its slot can be reused.
+static inline bool ring_publish(ring_cursor_t * prod, const ring_cursor_t * cons, uint8_t slots)
+{
+    if (ring_pending(prod, cons) + 1 >= slots)
+        return false;
+    ring_advance(prod, slots);
+    return true;
+}
+
+/// Move the producer on to the next slot without publishing the current
+/// one, so it is recorded over once the producer comes round again.
+static inline void ring_skip(ring_cursor_t * prod, uint8_t slots)
+{
+    prod->slot = (prod->slot + 1 == slots) ? 0 : prod->slot + 1;
+}
+
+/// After ring_skip()ping, publish the last `history` skipped chunks and then
+/// the current one, in order; `history` at most slots-2. This points the
+/// consumer's cursor back at the oldest, the one write to a cursor from the
+/// producer's side. It is only safe with nothing pending: the consumer
+/// touches its cursor only to take a published chunk, so it is idle until
+/// `count` moves, and the sampling ISR that calls this can't be preempted
+/// by the USB side between the two writes.
+static inline void ring_publish_history(ring_cursor_t * prod, ring_cursor_t * cons,
+                                        uint8_t slots, uint8_t history)
+{
+    cons->slot = (prod->slot + slots - history) % slots;
+    ring_advance(prod, slots);
+    prod->count += history;
+}
+
+#endif // _BULK_RING_H_
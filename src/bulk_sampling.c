@@ -4,32 +4,143 @@
 #include "board_io.h"
 #include "main.h" // for frame_number
 #include "conf_board.h"
+#include "conf_sampling.h"
+#include "bulk_ring.h"
+#include "profile.h"
+#include "dac_queue.h"
+#include "calibration.h"
 
-#define CHUNK_SAMPLES  (256)
-#define IN_PACKET_SIZE  (sizeof(uint16_t)*CHUNK_SAMPLES*4)
-#define OUT_PACKET_SIZE  (sizeof(uint16_t)*CHUNK_SAMPLES*2)
+#define IN_SLOT_BYTES(n)    ((n)*4*2) // 4 IN 16-bit words per sample
+#define OUT_SLOT_BYTES(n)   ((n)*2*2) // 2 OUT 16-bit words per sample
+#define WAVE_BYTES          (WAVE_TABLE_SAMPLES*2*2)
+
+#if (BULK_RING_MIN_SLOTS*(IN_SLOT_BYTES(CHUNK_SAMPLES_MAX)+OUT_SLOT_BYTES(CHUNK_SAMPLES_MAX))) > BULK_RING_BYTES
+#error "CHUNK_SAMPLES_MAX chunks do not fit in BULK_RING_BYTES"
+#endif
+#if (BULK_RING_MIN_SLOTS*IN_SLOT_BYTES(CHUNK_SAMPLES_MAX)) > (BULK_RING_BYTES - WAVE_BYTES)
+#error "CHUNK_SAMPLES_MAX chunks do not fit beside the waveform tables"
+#endif
 
 typedef struct {
-    uint16_t in[CHUNK_SAMPLES*4];
-    uint16_t out[CHUNK_SAMPLES*2];
+    bulk_header_t * hdr;    // immediately before `in`, or hdr_scratch
+    uint16_t * in;          // chunk_samples*in_words()
+    uint16_t * out;         // chunk_samples*2, unused during playback
+    bool calibrated;        // `in` holds calibrated values rather than codes
 } bulk_buffer_t;
 
+static uint32_t sample_pool[BULK_RING_BYTES/sizeof(uint32_t)];
 
 static bool start_timer = false;
 static volatile uint16_t start_frame = 0;
 
-static volatile bool send_in;
-static volatile bool send_out;
+static volatile bool out_enabled;
 static volatile bool sending_in;
 static volatile bool sending_out;
-static volatile bool sent_in;
-static volatile bool sent_out;
+static volatile bool streaming;
+static volatile uint8_t stream_gen;     // bumped each time the ring is reset
+
+/// Stream options that size the ring, fixed for the duration of a stream.
+/// Setters validate a modified copy with conf_apply().
+typedef struct {
+    uint16_t chunk_samples;
+    uint16_t decimation;    // 1 = off
+    uint8_t mask;           // BULK_CHAN_*
+    uint8_t dio_pins;       // PA0-3 driven each sample, 0 = none
+    uint16_t dio_loop;      // pattern table samples, 0 = pattern from the OUT stream
+    bool header;
+    bool playback;
+    bool trigger;
+    uint8_t trig_meas;      // BULK_CHAN_* bit the trigger compares, 0 for a pin
+    bool calibrated;
+} stream_conf_t;
+
+static stream_conf_t conf = {
+    .chunk_samples = CHUNK_SAMPLES_DEFAULT,
+    .decimation = 1,
+    .mask = BULK_CHAN_ALL,
+};
+
+// Waveform playback: the DAC words come from per-channel tables at the top
+// of sample_pool instead of the OUT endpoint, and streaming is IN-only.
+static uint16_t wave_loop[2];
+static bool wave_valid[2];
+static uint16_t * const wave_table = (uint16_t *)sample_pool + (BULK_RING_BYTES - WAVE_BYTES)/2;
+
+// Decimation: each IN sample is the sum of `conf.decimation` consecutive ADC
+// samples. Only available during playback, as the OUT stream would need
+// that many times more data than the IN stream returns.
+static uint32_t dec_steps;              // ISR invocations per decimated sample
+static volatile uint32_t dec_ctr;
+static uint32_t * dec_out;              // next decimated sample in the IN slot
+
+// Triggered capture: chunks are recorded round the ring without being
+// uploaded until the trigger fires, then the last `pre` of them, the
+// trigger chunk and `post` more are published and sampling stops.
+// A falling edge is detected as a rising edge of the inverted signal.
+static uint8_t trig_source = TRIG_SRC_OFF;
+static uint16_t trig_pre_samples;
+static uint16_t trig_post_samples;
+static uint16_t trig_xor;               // 0xFFFF for falling edges
+static uint16_t trig_level;             // compared after trig_xor
+static uint32_t trig_pin;               // PIOA bit for digital sources
+static uint8_t trig_chan;               // channel whose ADC word is watched
+static bool trig_adc2;
+static uint16_t trig_idle;              // reads as "above level" before the first sample
+static uint16_t * trig_word;            // latest word of the watched measurement
+static uint16_t trig_prev;
+static uint8_t trig_pre_chunks;
+static uint8_t trig_post_chunks;
+static uint8_t armed_chunks;
+static volatile bulk_trigger_status_t trig_status;
 
-static bulk_buffer_t buffers[2];
-static volatile bulk_buffer_t * active_buffer = &(buffers[0]);
-static volatile bulk_buffer_t * comm_buffer = &(buffers[1]);
+// IN calibration: the ISR stores ADC codes in the first half of each slot's
+// measurements, and BULK_Handler expands them in place to 32-bit uV and
+// uA before the chunk is sent. A chunk is `cal_runs` runs of chunk_samples
+// samples, each of `cal_words` words, calibrated with successive paths.
+static const cal_entry_t * cal_paths[4];
+static uint8_t cal_runs;
+static uint8_t cal_words;
 
-static bool interleave_data = false;
+// Packet geometry derived from conf when a stream is configured.
+static uint32_t chunk_steps;    // ISR invocations per chunk, two per sample
+static uint32_t in_packet_size;
+static uint32_t out_packet_size;
+static uint32_t in_header_size;
+
+// DIO capture: PA0-3 are latched at channel A's step of each sample into a
+// track after the measurements, four samples to a word, the first in the
+// low nibble.
+static uint32_t dio_offset;             // words from the start of an IN slot
+static uint16_t * volatile dio_track;   // current slot's track, NULL if not captured
+
+// DIO output: PA0-3 are written at channel B's step of each sample, as
+// LDAC loads channel A's word for it, from a pattern packed like the input
+// track. The pattern follows the DAC words in each OUT slot, or loops
+// through dio_table. PIO_OWSR holds just the driven pins, so one PIO_ODSR
+// store sets them and leaves the rest of PIOA alone.
+static uint16_t dio_table[DIO_TABLE_SAMPLES/4];
+static bool dio_table_valid;
+static uint32_t dio_out_offset;             // words from the start of an OUT slot
+static const uint16_t * volatile dio_pattern; // NULL if no pins are driven
+static uint16_t dio_pos;                    // next table sample
+
+// Ring of sample buffers carved out of sample_pool. The ISR produces IN chunks
+// and consumes OUT chunks; the bulk endpoints do the opposite. The slot being
+// written or played by the ISR is never handed to USB, and vice versa.
+static bulk_buffer_t buffers[BULK_RING_MAX_SLOTS];
+static uint8_t ring_slots;
+static ring_cursor_t in_prod;   // ISR: IN chunks captured
+static ring_cursor_t in_cons;   // bulk IN: chunks sent to the host
+static ring_cursor_t out_prod;  // bulk OUT: chunks received from the host
+static ring_cursor_t out_cons;  // ISR: OUT chunks played
+
+static volatile bulk_stats_t stats;
+
+// Header bookkeeping. Headers are always written by the ISR; with headers
+// disabled they land in hdr_scratch and are never sent.
+static bulk_header_t hdr_scratch;
+static uint32_t chunk_seq;
+static uint16_t chunk_flags;
 
 // reversed endianness from AD7682 datasheet
 // Note: the above comment appears to be incorrect?
@@ -40,12 +151,47 @@ static bool interleave_data = false;
 static uint16_t v_adc_conf = 0x20F1;// 0010 0000 1111 0001
 static uint16_t i_adc_conf = 0x20F7;// 0010 0000 1111 0111
 
+/// Per-channel PDC setup for one ISR invocation.
+/// Built once per stream by the layout's build function; the sampling
+/// handler only loads from it and steps the three running pointers.
+typedef struct {
+    uint16_t * out;         // DAC word, USART0 TNPR
+    uint16_t * out_start;   // waveform loop, playback only
+    uint16_t * out_end;
+    uint16_t * adc1_rx;     // USART1 RPR
+    uint16_t * adc2_rx;     // USART2 RPR
+    uint32_t adc1_conf;     // USART1 TPR
+    uint32_t adc2_conf;     // USART2 TPR
+    uint16_t out_offset;    // offsets of sample 0 from the slot base, in words
+    uint16_t adc1_offset;
+    uint16_t adc2_offset;
+    uint8_t adc1_step;      // per sample, in words; 0 if not captured
+    uint8_t adc2_step;
+    uint16_t dec_rx[2];     // ADC words awaiting accumulation, decimation only
+    uint32_t adc1_sum;
+    uint32_t adc2_sum;
+    uint8_t chan_id;        // DAC command byte, USART0 TPR
+} dma_desc_t;
+
+/// A packet layout: how a slot is filled, and the handler specialised for it.
+enum {
+    LAYOUT_PLANAR,
+    LAYOUT_INTERLEAVED,
+    LAYOUT_MASKED,
+};
+
+typedef struct {
+    void (*build)(void);
+    void (*handler)(void);      // DAC words from the OUT stream
+    void (*play_handler)(void); // DAC words from the waveform tables
+} sample_layout_t;
+
+static dma_desc_t dma_desc[2];
 static volatile uint8_t current_chan;
 static volatile uint32_t sample_ctr;
-static volatile uint8_t output_chan_id;
-static volatile uint16_t * signal_out;
-static volatile uint16_t * meas_v_in;
-static volatile uint16_t * meas_i_in;
+
+// receives measurements left out of the channel mask
+static uint16_t adc_discard;
 
 
 static void main_vendor_bulk_out_received(udd_ep_status_t status,
@@ -54,79 +200,592 @@ static void main_vendor_bulk_out_received(udd_ep_status_t status,
 static void main_vendor_bulk_in_received(udd_ep_status_t status,
                                          iram_size_t nb_transfered,
                                          udd_ep_id_t ep);
+static void build_planar(void);
+static void build_interleaved(void);
+static void build_masked(void);
+RAMFUNC static void sample_planar(void);
+RAMFUNC static void sample_interleaved(void);
+RAMFUNC static void play_planar(void);
+RAMFUNC static void play_interleaved(void);
+RAMFUNC static void sample_masked(void);
+RAMFUNC static void play_masked(void);
+RAMFUNC static void play_decimated(void);
+RAMFUNC static void play_triggered(void);
+static inline void set_chunk_pointers(void);
+static void layout_ring(void);
+static uint8_t ring_depth(const stream_conf_t * c);
+static void arm_trigger(void);
+static uint8_t mask_count(uint8_t mask);
+static void plan_calibration(bool planar);
+
+/// Have handle_bulk_transfers() run from BULK_IRQn, as soon as nothing more
+/// urgent is running.
+static inline void pend_bulk_transfers(void)
+{
+    PROFILE_MARK(PROF_BULK);
+    NVIC_SetPendingIRQ(BULK_IRQn);
+}
 
+static const sample_layout_t layouts[] = {
+    [LAYOUT_PLANAR] = { build_planar, sample_planar, play_planar },
+    [LAYOUT_INTERLEAVED] = { build_interleaved, sample_interleaved, play_interleaved },
+    [LAYOUT_MASKED] = { build_masked, sample_masked, play_masked },
+};
+static const sample_layout_t * layout = &layouts[LAYOUT_PLANAR];
 
-void config_bulk_sampling(uint16_t period, uint16_t sync)
+/// Installed when a stream starts; runs from SRAM like TC2_Handler itself.
+static void (* volatile sample_handler)(void) = sample_planar;
+
+
+bool config_bulk_sampling(uint16_t period, uint16_t sync)
 {
+    // A chunk is calibrated while the next is sampled, in at most a quarter
+    // of what the sampling ISR leaves of each sample's 4*period core cycles.
+    if (conf.calibrated && (period > 1) &&
+        (4*mask_count(conf.mask)*CAL_CYCLES_PER_WORD + SAMPLE_ISR_CYCLES > 4*(uint32_t)period))
+        return false;
+
     tc_stop(TC0, 2);
+    dac_queue_pace(false);
     
     if (period > 1)
     {
+        stream_gen++;
         start_timer = false;
         udd_ep_abort(UDI_VENDOR_EP_BULK_IN);
         udd_ep_abort(UDI_VENDOR_EP_BULK_OUT);
-        sent_out = false;
-        sent_in = false;
+        streaming = false;
         sending_in = false;
         sending_out = false;
-        send_out = true;
-        send_in = false;
+        layout_ring();
+        chunk_seq = 0;
+        chunk_flags = 0;
+        ring_reset(&in_prod);
+        ring_reset(&in_cons);
+        ring_reset(&out_prod);
+        ring_reset(&out_cons);
+        // playback needs no OUT data, so it is armed straight away
+        out_enabled = !conf.playback;
+        streaming = conf.playback;
+        start_timer = conf.playback;
+        arm_trigger();
         
         tc_write_ra(TC0, 2, 10);
         tc_write_rb(TC0, 2, period-4);
         tc_write_rc(TC0, 2, period);
         start_frame = sync;
+        pend_bulk_transfers();
     }
+    else
+    {
+        out_enabled = false;
+        streaming = false;
+    }
+    return true;
+}
+
+/// adopt `c` if the ring still fits and no stream is running
+static bool conf_apply(const stream_conf_t * c)
+{
+    // geometry can only change between streams
+    if (streaming || start_timer)
+        return false;
+    if (ring_depth(c) < BULK_RING_MIN_SLOTS)
+        return false;
+    // decimation and triggered capture need the IN-only stream of playback
+    if (((c->decimation > 1) || c->trigger) && !c->playback)
+        return false;
+    // a decimated sample spans many pin states
+    if ((c->decimation > 1) && (c->mask & BULK_CHAN_DIO))
+        return false;
+    // playback has no OUT stream to carry a pattern
+    if (c->dio_pins && !c->dio_loop && c->playback)
+        return false;
+    if ((c->decimation > 1) && c->trigger)
+        return false;
+    // the trigger reads its measurement where the ISR stores it
+    if (c->trigger && c->trig_meas && !(c->mask & c->trig_meas))
+        return false;
+    // decimated sums would need the offset scaled by the ratio
+    if ((c->decimation > 1) && c->calibrated)
+        return false;
+    conf = *c;
+    return true;
+}
+
+bool bulk_set_chunk_size(uint16_t samples)
+{
+    stream_conf_t c = conf;
+    if ((samples < CHUNK_SAMPLES_MIN) || (samples > CHUNK_SAMPLES_MAX) || (samples % 16))
+        return false;
+    c.chunk_samples = samples;
+    return conf_apply(&c);
+}
+
+bool bulk_set_header(bool enable)
+{
+    stream_conf_t c = conf;
+    c.header = enable;
+    return conf_apply(&c);
+}
+
+bool bulk_set_calibrated(bool enable)
+{
+    stream_conf_t c = conf;
+    if (enable && !calibration_table())
+        return false;
+    c.calibrated = enable;
+    return conf_apply(&c);
+}
+
+bool bulk_idle(void)
+{
+    return !(streaming || start_timer);
+}
+
+uint8_t * bulk_borrow_pool(uint32_t bytes)
+{
+    if (streaming || start_timer || (bytes > BULK_RING_BYTES - WAVE_BYTES))
+        return NULL;
+    out_enabled = false;
+    udd_ep_abort(UDI_VENDOR_EP_BULK_OUT);
+    return (uint8_t *)sample_pool;
+}
+
+uint8_t * bulk_wave_buffer(uint8_t chan, uint16_t offset, uint16_t bytes)
+{
+    if (streaming || start_timer || (chan > B))
+        return NULL;
+    if ((bytes % 2) || ((uint32_t)offset*2 + bytes > WAVE_TABLE_SAMPLES*2))
+        return NULL;
+    // valid again once the data stage has arrived
+    wave_valid[chan] = false;
+    return (uint8_t *)(wave_table + chan*WAVE_TABLE_SAMPLES + offset);
+}
+
+void bulk_wave_loaded(uint8_t chan)
+{
+    if (chan <= B)
+        wave_valid[chan] = true;
+}
+
+bool bulk_set_wave_loop(uint8_t chan, uint16_t samples)
+{
+    stream_conf_t c = conf;
+    if ((chan > B) || (samples > WAVE_TABLE_SAMPLES))
+        return false;
+    if (samples && !wave_valid[chan])
+        return false;
+    c.playback = samples || wave_loop[chan ^ 1];
+    if (!conf_apply(&c))
+        return false;
+    wave_loop[chan] = samples;
+    return true;
+}
+
+uint8_t * bulk_dio_pattern_buffer(uint16_t offset, uint16_t bytes)
+{
+    if (streaming || start_timer)
+        return NULL;
+    // two samples to a byte
+    if ((offset % 2) || ((uint32_t)offset/2 + bytes > sizeof(dio_table)))
+        return NULL;
+    dio_table_valid = false;
+    return (uint8_t *)dio_table + offset/2;
+}
+
+void bulk_dio_pattern_loaded(void)
+{
+    dio_table_valid = true;
+}
+
+bool bulk_set_dio_output(uint8_t pins, uint16_t loop)
+{
+    stream_conf_t c = conf;
+    if ((pins & ~0xF) || (loop > DIO_TABLE_SAMPLES))
+        return false;
+    if (pins && loop && !dio_table_valid)
+        return false;
+    c.dio_pins = pins;
+    c.dio_loop = pins ? loop : 0;
+    if (!conf_apply(&c))
+        return false;
+    pio_disable_output_write(PIOA, 0xF & ~pins);
+    if (pins) {
+        pio_set_output(PIOA, pins, LOW, DISABLE, DISABLE);
+        pio_enable_output_write(PIOA, pins);
+    }
+    return true;
+}
+
+bool bulk_set_decimation(uint16_t ratio)
+{
+    stream_conf_t c = conf;
+    if ((ratio < 1) || (ratio > DECIMATION_MAX))
+        return false;
+    c.decimation = ratio;
+    return conf_apply(&c);
+}
+
+bool bulk_set_channel_mask(uint8_t mask)
+{
+    stream_conf_t c = conf;
+    if ((mask == 0) || (mask & ~(BULK_CHAN_ALL | BULK_CHAN_DIO)))
+        return false;
+    c.mask = mask;
+    return conf_apply(&c);
+}
+
+bool bulk_set_trigger(uint8_t source, bool falling, uint16_t level)
+{
+    stream_conf_t c = conf;
+    if ((source > TRIG_SRC_PA3) && (source != TRIG_SRC_OFF))
+        return false;
+    c.trigger = (source != TRIG_SRC_OFF);
+    c.trig_meas = (source < TRIG_SRC_PA0) ? 1 << source : 0;
+    if (!conf_apply(&c))
+        return false;
+    trig_source = source;
+    trig_xor = falling ? 0xFFFF : 0;
+    if (source >= TRIG_SRC_PA0) {
+        // pin states read as 0 or 0xFFFF
+        trig_pin = 1 << (source - TRIG_SRC_PA0);
+        trig_level = 0x8000;
+    }
+    else {
+        trig_pin = 0;
+        trig_level = level ^ trig_xor;
+        // V_A, I_A: channel A's ADC1, ADC2; V_B, I_B: channel B's ADC2, ADC1
+        trig_chan = (source < TRIG_SRC_V_B) ? A : B;
+        trig_adc2 = (source == TRIG_SRC_I_A) || (source == TRIG_SRC_V_B);
+    }
+    trig_idle = ~trig_xor;
+    return true;
+}
+
+bool bulk_set_trigger_window(uint16_t pre_samples, uint16_t post_samples)
+{
+    if (streaming || start_timer)
+        return false;
+    trig_pre_samples = pre_samples;
+    trig_post_samples = post_samples;
+    return true;
+}
+
+void bulk_read_trigger(bulk_trigger_status_t * out)
+{
+    irqflags_t flags = cpu_irq_save();
+    *out = trig_status;
+    cpu_irq_restore(flags);
+}
+
+/// reset the trigger state machine for a new stream
+static void arm_trigger(void)
+{
+    uint16_t n = conf.chunk_samples;
+    
+    trig_status = (bulk_trigger_status_t){0};
+    if (!conf.trigger)
+        return;
+    // The ISR writes one slot while the pre-trigger and trigger chunks wait
+    // to be sent, so at most ring_slots-2 chunks of history are kept.
+    trig_pre_chunks = Min((trig_pre_samples + n - 1)/n, ring_slots - 2);
+    trig_post_chunks = Min((trig_post_samples + n - 1)/n, 0xFF);
+    armed_chunks = 0;
+    trig_word = &trig_idle;
+    trig_prev = 0xFFFF;
+    trig_status.state = TRIG_ARMED;
 }
 
 void bulk_set_interleave(bool interleave)
 {
-    interleave_data = interleave;
+    // takes effect when the next stream starts
+    layout = &layouts[interleave ? LAYOUT_INTERLEAVED : LAYOUT_PLANAR];
+}
+
+/// number of measurements selected by a BULK_CHAN_* mask
+static uint8_t mask_count(uint8_t mask)
+{
+    return ((mask >> 0) & 1) + ((mask >> 1) & 1) + ((mask >> 2) & 1) + ((mask >> 3) & 1);
+}
+
+/// 16-bit words per sample in an IN slot
+static uint8_t in_words(const stream_conf_t * c)
+{
+    // decimated sums and calibrated values are 32 bits wide
+    return mask_count(c->mask) * (((c->decimation > 1) || c->calibrated) ? 2 : 1);
+}
+
+/// 16-bit words of DIO track in an IN slot
+static uint16_t dio_words(const stream_conf_t * c)
+{
+    return (c->mask & BULK_CHAN_DIO) ? c->chunk_samples/4 : 0;
+}
+
+/// 16-bit words of DIO pattern in an OUT slot
+static uint16_t dio_out_words(const stream_conf_t * c)
+{
+    return (c->dio_pins && !c->dio_loop) ? c->chunk_samples/4 : 0;
+}
+
+/// RAM needed for one ring slot
+static uint32_t slot_bytes(const stream_conf_t * c)
+{
+    return (c->header ? sizeof(bulk_header_t) : 0) +
+           (c->chunk_samples*in_words(c) + dio_words(c))*2 +
+           (c->playback ? 0 : OUT_SLOT_BYTES(c->chunk_samples) + dio_out_words(c)*2);
+}
+
+/// number of ring slots that fit in sample_pool
+static uint8_t ring_depth(const stream_conf_t * c)
+{
+    uint32_t avail = BULK_RING_BYTES - (c->playback ? WAVE_BYTES : 0);
+    return Min(avail/slot_bytes(c), BULK_RING_MAX_SLOTS);
+}
+
+/// split sample_pool into as many slots of the current chunk size as fit
+static void layout_ring(void)
+{
+    uint32_t size = slot_bytes(&conf);
+    uint16_t n = conf.chunk_samples;
+    
+    in_header_size = conf.header ? sizeof(bulk_header_t) : 0;
+    ring_slots = ring_depth(&conf);
+    for (uint8_t i = 0; i < ring_slots; i++) {
+        uint8_t * base = (uint8_t *)sample_pool + i*size;
+        buffers[i].hdr = conf.header ? (bulk_header_t *)base : &hdr_scratch;
+        buffers[i].in = (uint16_t *)(base + in_header_size);
+        buffers[i].out = buffers[i].in + n*in_words(&conf) + dio_words(&conf);
+    }
+    dio_offset = n*in_words(&conf);
+    dio_out_offset = n*2;
+    // an OUT-stream ring may have reused the waveform table memory
+    if (!conf.playback && (ring_slots*size > BULK_RING_BYTES - WAVE_BYTES))
+        wave_valid[A] = wave_valid[B] = false;
+    // a decimated chunk ends after chunk_samples sums rather than ISR steps
+    chunk_steps = (conf.decimation > 1) ? n : n*2;
+    dec_steps = conf.decimation*2;
+    in_packet_size = in_header_size + sizeof(uint16_t)*(n*in_words(&conf) + dio_words(&conf));
+    out_packet_size = sizeof(uint16_t)*(n*2 + dio_out_words(&conf));
+}
+
+void bulk_read_stats(bulk_stats_t * out, bool reset)
+{
+    irqflags_t flags = cpu_irq_save();
+    *out = stats;
+    if (reset)
+        stats = (bulk_stats_t){0};
+    cpu_irq_restore(flags);
 }
 
 void poll_trigger(void)
 {
     if (start_timer && ((frame_number == start_frame) || (start_frame == 0)))
     {
-        // Perform initial buffer swap: active_buffer is empty, comm_buffer has output signal data.
-        volatile bulk_buffer_t * tmp = active_buffer;
-        active_buffer = comm_buffer;
-        comm_buffer = tmp;
-        
-        // Set up pointers for first chunk of samples.
-        current_chan = A;
-        sample_ctr = 0;
-        signal_out = active_buffer->out;
-        meas_v_in = active_buffer->in;
-        if(unlikely(interleave_data))
-            meas_i_in = meas_v_in + 1;
+        // Set up pointers for first chunk of samples: the first OUT chunk has
+        // arrived in slot 0 (or playback starts at the top of each table),
+        // and IN slot 0 is empty.
+        // Triggered capture packs samples like a channel mask, as its
+        // handler steps the receive pointers by per-ADC amounts.
+        bool masked = ((conf.mask & BULK_CHAN_ALL) != BULK_CHAN_ALL) || conf.trigger;
+        const sample_layout_t * l = masked ? &layouts[LAYOUT_MASKED] : layout;
+        l->build();
+        for (uint8_t c = A; c <= B; c++) {
+            dma_desc[c].out_start = wave_table + c*WAVE_TABLE_SAMPLES;
+            dma_desc[c].out_end = dma_desc[c].out_start + Max(wave_loop[c], 1);
+            dma_desc[c].out = dma_desc[c].out_start;
+            dma_desc[c].dec_rx[0] = dma_desc[c].dec_rx[1] = 0;
+            dma_desc[c].adc1_sum = dma_desc[c].adc2_sum = 0;
+        }
+        // the first step has no earlier transfer to add, only a zero word
+        dec_ctr = UINT32_MAX;
+        dio_pos = 0;
+        if (conf.calibrated)
+            plan_calibration(l == &layouts[LAYOUT_PLANAR]);
+        set_chunk_pointers();
+        if (conf.decimation > 1)
+            sample_handler = play_decimated;
+        else if (conf.trigger)
+            sample_handler = play_triggered;
         else
-            meas_i_in = meas_v_in + CHUNK_SAMPLES;
+            sample_handler = conf.playback ? l->play_handler : l->handler;
         
+        dac_queue_pace(true);
         tc_start(TC0, 2);
         start_timer = false;
     }
 }
 
+/// the calibration path of each IN word, for the layout starting now
+static void plan_calibration(bool planar)
+{
+    // BULK_CHAN_* order
+    static const uint8_t meas_path[4] = { CAL_A_MEAS_V, CAL_A_MEAS_I, CAL_B_MEAS_V, CAL_B_MEAS_I };
+    const cal_table_t * t = calibration_table();
+    uint8_t words = 0;
+    
+    for (uint8_t i = 0; i < 4; i++) {
+        if (conf.mask & (1 << i))
+            cal_paths[words++] = &t->path[meas_path[i]];
+    }
+    // planar chunks are a run of chunk_samples words per measurement, the
+    // others one run of all the measurements of each sample
+    cal_runs = planar ? words : 1;
+    cal_words = planar ? 1 : words;
+}
+
+/// Replace a chunk's ADC codes with calibrated values, just before it is sent.
+static void calibrate_chunk(bulk_buffer_t * b)
+{
+    PROFILE_BEGIN(PROF_CAL);
+    uint32_t run = conf.chunk_samples*cal_words;
+    // last run first: each expands over the codes of the ones after it
+    for (uint8_t r = cal_runs; r-- > 0; )
+        calibration_convert(b->in, r*run, conf.chunk_samples, cal_words, &cal_paths[r*cal_words]);
+    b->hdr->flags |= BULK_HDR_CALIBRATED;
+    PROFILE_END(PROF_CAL);
+}
+
 void enable_bulk_transfers(void)
 {
-    main_vendor_bulk_in_received(UDD_EP_TRANSFER_OK, 0, 0);
+    sending_in = false;
+    pend_bulk_transfers();
 }
 
-void handle_bulk_transfers(void)
+void bulk_sampling_init(void)
 {
-    if ((!sending_in) & send_in) {
-        send_in = false;
-        sending_in = true;
-        udi_vendor_bulk_in_run((uint8_t *)(comm_buffer->in), IN_PACKET_SIZE,
-                               main_vendor_bulk_in_received);
+    NVIC_SetPriority(BULK_IRQn, BULK_IRQ_PRIORITY);
+    NVIC_EnableIRQ(BULK_IRQn);
+}
+
+/// Start whichever transfers can start. config_bulk_sampling() resets the
+/// ring from the UDPHS interrupt, which preempts this, so each check and
+/// submission runs with it masked: a transfer submitted after the reset
+/// would send a stale slot and advance the new ring's cursors. Converting a
+/// chunk can take most of a millisecond, too long to hold off SOFs, so it
+/// runs unmasked and the chunk is dropped if a reset came meanwhile.
+static void handle_bulk_transfers(void)
+{
+    uint32_t basepri = __get_BASEPRI();
+    uint8_t gen = stream_gen;
+    if ((!sending_in) & (ring_pending(&in_prod, &in_cons) > 0)) {
+        bulk_buffer_t * b = &buffers[in_cons.slot];
+        // a chunk sent again after an abort is already converted
+        bool convert = conf.calibrated && !b->calibrated;
+        if (convert)
+            calibrate_chunk(b);
+        __set_BASEPRI(BULK_SUBMIT_BASEPRI);
+        if (gen == stream_gen) {
+            b->calibrated |= convert;
+            sending_in = true;
+            udi_vendor_bulk_in_run((uint8_t *)(b->in) - in_header_size, in_packet_size,
+                                   main_vendor_bulk_in_received);
+        }
+        __set_BASEPRI(basepri);
     }
-    if ((!sending_out) & send_out) {
-        send_out = false;
+    // Receive into a slot as soon as the ISR has finished playing it.
+    __set_BASEPRI(BULK_SUBMIT_BASEPRI);
+    if ((!sending_out) & out_enabled &
+        (ring_pending(&out_prod, &out_cons) < ring_slots)) {
         sending_out = true;
-        udi_vendor_bulk_out_run((uint8_t *)(comm_buffer->out), OUT_PACKET_SIZE,
+        udi_vendor_bulk_out_run((uint8_t *)(buffers[out_prod.slot].out), out_packet_size,
                                 main_vendor_bulk_out_received);
     }
+    __set_BASEPRI(basepri);
+}
+
+void BULK_Handler(void)
+{
+    PROFILE_SINCE_MARK(PROF_BULK);
+    handle_bulk_transfers();
+}
+
+/// fill the parts of the DMA table common to every layout
+static void build_channels(uint16_t n)
+{
+    // Channel A: ADC1 returns V, ADC2 returns I
+    dma_desc[A].chan_id = A;
+    dma_desc[A].adc1_conf = (uint32_t)&v_adc_conf;
+    dma_desc[A].adc2_conf = (uint32_t)&i_adc_conf;
+    dma_desc[A].out_offset = 0;
+    dma_desc[A].adc1_offset = 0;
+    dma_desc[A].adc2_offset = n;
+    // Channel B: ADC1 returns I, ADC2 returns V
+    dma_desc[B].chan_id = B;
+    dma_desc[B].adc1_conf = (uint32_t)&i_adc_conf;
+    dma_desc[B].adc2_conf = (uint32_t)&v_adc_conf;
+    dma_desc[B].out_offset = n;
+    dma_desc[B].adc1_offset = 3*n;
+    dma_desc[B].adc2_offset = 2*n;
+}
+
+/// V_A[], I_A[], V_B[], I_B[] in, A[], B[] out
+static void build_planar(void)
+{
+    build_channels(conf.chunk_samples);
+    dma_desc[A].adc1_step = dma_desc[A].adc2_step = 1;
+    dma_desc[B].adc1_step = dma_desc[B].adc2_step = 1;
+}
+
+/// {V_A, I_A, V_B, I_B}[] in, {A, B}[] out
+static void build_interleaved(void)
+{
+    build_channels(1);
+    dma_desc[A].adc1_step = dma_desc[A].adc2_step = 4;
+    dma_desc[B].adc1_step = dma_desc[B].adc2_step = 4;
+}
+
+/// {selected of V_A, I_A, V_B, I_B}[] in, {A, B}[] out
+static void build_masked(void)
+{
+    uint8_t words = mask_count(conf.mask);
+    uint8_t pos = 0;
+    
+    build_channels(1);
+    for (uint8_t i = 0; i < 4; i++) {
+        // V_A and I_A come from channel A's ADC1 and ADC2, V_B and I_B from
+        // channel B's ADC2 and ADC1
+        dma_desc_t * d = &dma_desc[(i < 2) ? A : B];
+        bool adc2 = (i == 1) || (i == 2);
+        uint16_t offset = 0;
+        uint8_t step = 0;
+        if (conf.mask & (1 << i)) {
+            offset = pos++;
+            step = words;
+        }
+        if (adc2) {
+            d->adc2_offset = offset;
+            d->adc2_step = step;
+        }
+        else {
+            d->adc1_offset = offset;
+            d->adc1_step = step;
+        }
+    }
+}
+
+/// point the ISR at the current IN and OUT slots, starting at channel A
+static inline void set_chunk_pointers(void)
+{
+    uint16_t * out = buffers[out_cons.slot].out;
+    uint16_t * in = buffers[in_prod.slot].in;
+    
+    for (uint8_t c = A; c <= B; c++) {
+        // waveform playback runs on across chunk boundaries
+        if (!conf.playback)
+            dma_desc[c].out = out + dma_desc[c].out_offset;
+        dma_desc[c].adc1_rx = dma_desc[c].adc1_step ? in + dma_desc[c].adc1_offset : &adc_discard;
+        dma_desc[c].adc2_rx = dma_desc[c].adc2_step ? in + dma_desc[c].adc2_offset : &adc_discard;
+    }
+    dec_out = (uint32_t *)in;
+    buffers[in_prod.slot].calibrated = false;
+    dio_track = (conf.mask & BULK_CHAN_DIO) ? in + dio_offset : NULL;
+    if (!conf.dio_pins)
+        dio_pattern = NULL;
+    else
+        dio_pattern = conf.dio_loop ? dio_table : out + dio_out_offset;
+    current_chan = A;
+    sample_ctr = 0;
 }
 
 static void main_vendor_bulk_in_received(udd_ep_status_t status,
@@ -136,11 +795,19 @@ static void main_vendor_bulk_in_received(udd_ep_status_t status,
     UNUSED(nb_transfered);
     UNUSED(ep);
     if (UDD_EP_TRANSFER_OK != status) {
-        return;
+        // the chunk stays queued and is sent again
+        stats.in_aborts++;
+        sending_in = false;
     }
     else {
+        ring_advance(&in_cons, ring_slots);
+        stats.in_packets++;
         sending_in = false;
+        // a triggered capture ends once the host has its last chunk
+        if ((trig_status.state == TRIG_DONE) && (ring_pending(&in_prod, &in_cons) == 0))
+            streaming = false;
     }
+    pend_bulk_transfers();
 }
 
 static void main_vendor_bulk_out_received(udd_ep_status_t status,
@@ -149,45 +816,175 @@ static void main_vendor_bulk_out_received(udd_ep_status_t status,
 {
     UNUSED(ep);
     if (UDD_EP_TRANSFER_OK != status) {
-        return;
+        stats.out_aborts++;
+        sending_out = false;
     }
     else {
-        if (sent_out == false) {
+        ring_advance(&out_prod, ring_slots);
+        stats.out_packets++;
+        if (streaming == false) {
             start_timer = true;
         }
-        sent_out = true;
+        streaming = true;
         sending_out = false;
     }
+    pend_bulk_transfers();
 }
 
 
-void TC2_Handler(void)
+/// End a triggered capture once its window has been published. The bulk IN
+/// endpoint carries on until the host has all of it, and then the stream.
+RAMFUNC static void stop_capture(void)
 {
-    // clear status register
-    TC0->TC_CHANNEL[2].TC_SR;
-    
-    PIOA->PIO_SODR = N_SYNC;
+    TC0->TC_CHANNEL[2].TC_CCR = TC_CCR_CLKDIS;
+    dac_queue_pace(false);
+    trig_status.state = TRIG_DONE;
+}
+
+/// Record where the trigger fired; the chunk is published when it completes.
+RAMFUNC __attribute__((noinline)) static void fire_trigger(void)
+{
+    trig_status.index = sample_ctr/2;
+    trig_status.seq = chunk_seq;
+    trig_status.state = TRIG_FIRED;
+    chunk_flags |= BULK_HDR_TRIGGER;
+}
+
+/// Chunk boundary: stamp the header, publish the IN chunk and move on to the
+/// next OUT chunk. Shared by all handlers, as it runs once per chunk.
+RAMFUNC __attribute__((noinline)) static void end_chunk(void)
+{
+    bulk_header_t * h = buffers[in_prod.slot].hdr;
+    h->seq = chunk_seq++;
+    h->frame = UDPHS->UDPHS_FNUM & (UDPHS_FNUM_FRAME_NUMBER_Msk | UDPHS_FNUM_MICRO_FRAME_NUM_Msk);
+    h->flags = chunk_flags;
+    chunk_flags = 0;
     
-    if(!sent_out)
-        return;
+    switch (trig_status.state) {
+    case TRIG_ARMED:
+        // Keep the chunk unpublished as pre-trigger history, recording
+        // over the oldest slot next. Nothing is queued for the host.
+        ring_skip(&in_prod, ring_slots);
+        if (armed_chunks < trig_pre_chunks)
+            armed_chunks++;
+        break;
+    case TRIG_FIRED:
+        // Hand the host the history, then this chunk, in order.
+        ring_publish_history(&in_prod, &in_cons, ring_slots, armed_chunks);
+        trig_status.pre = armed_chunks;
+        trig_status.state = TRIG_POST;
+        if (trig_post_chunks == 0)
+            stop_capture();
+        break;
+    default:
+        // Publish the captured chunk, unless the next slot is still queued
+        // for the host, in which case this chunk is dropped and its slot
+        // reused.
+        if (!ring_publish(&in_prod, &in_cons, ring_slots)) {
+            stats.in_overruns++;
+            chunk_flags |= BULK_HDR_OVERRUN;
+        }
+        if ((trig_status.state == TRIG_POST) && (++trig_status.post == trig_post_chunks))
+            stop_capture();
+        break;
+    }
+    // Move on to the next OUT chunk if it has arrived, else replay this one.
+    if (conf.playback) {
+        // no OUT stream
+    }
+    else if (ring_pending(&out_prod, &out_cons) > 1) {
+        ring_advance(&out_cons, ring_slots);
+    }
+    else {
+        stats.out_underruns++;
+        chunk_flags |= BULK_HDR_UNDERRUN;
+    }
     
-    output_chan_id = current_chan;
-    USART0->US_TPR = (uint32_t)&output_chan_id;
-    USART0->US_TNPR = (uint32_t)signal_out;
-    if(current_chan == A)
-    {
-        USART1->US_TPR = (uint32_t)&v_adc_conf;
-        USART1->US_RPR = (uint32_t)meas_v_in;
-        USART2->US_TPR = (uint32_t)&i_adc_conf;
-        USART2->US_RPR = (uint32_t)meas_i_in;
+    set_chunk_pointers();
+    // the chunk can go out, and the OUT slot just played can be refilled
+    pend_bulk_transfers();
+}
+
+/// Store one decimated sample: the selected of {V_A, I_A, V_B, I_B} as
+/// little-endian sums.
+RAMFUNC __attribute__((noinline)) static void end_decimated(void)
+{
+    uint32_t sums[4] = {
+        dma_desc[A].adc1_sum, dma_desc[A].adc2_sum,
+        dma_desc[B].adc2_sum, dma_desc[B].adc1_sum,
+    };
+    uint32_t * o = dec_out;
+    for (uint8_t i = 0; i < 4; i++) {
+        if (conf.mask & (1 << i))
+            *o++ = sums[i];
     }
+    dec_out = o;
+    dma_desc[A].adc1_sum = dma_desc[A].adc2_sum = 0;
+    dma_desc[B].adc1_sum = dma_desc[B].adc2_sum = 0;
+    dec_ctr = 0;
+    
+    if (++sample_ctr == chunk_steps)
+        end_chunk();
+}
+
+/// Latch PA0-3 for the sample whose channel A step this is.
+static inline __attribute__((always_inline)) void capture_dio(uint16_t * track)
+{
+    uint32_t k = sample_ctr >> 1;
+    uint16_t pins = PIOA->PIO_PDSR & 0xF;
+    if (k & 3)
+        track[k >> 2] |= pins << ((k & 3)*4);
     else
-    {
-        USART1->US_TPR = (uint32_t)&i_adc_conf;
-        USART1->US_RPR = (uint32_t)meas_i_in;
-        USART2->US_TPR = (uint32_t)&v_adc_conf;
-        USART2->US_RPR = (uint32_t)meas_v_in;
+        track[k >> 2] = pins;
+}
+
+/// Drive PA0-3 for the sample whose channel B step this is.
+static inline __attribute__((always_inline)) void drive_dio(const uint16_t * pattern)
+{
+    uint32_t k;
+    if (conf.dio_loop) {
+        k = dio_pos;
+        if (++dio_pos == conf.dio_loop)
+            dio_pos = 0;
+    }
+    else {
+        k = sample_ctr >> 1;
+    }
+    // only the driven pins are enabled in PIO_OWSR, so the rest is ignored
+    PIOA->PIO_ODSR = pattern[k >> 2] >> ((k & 3)*4);
+}
+
+/// in_step for layouts whose per-ADC steps are only known at stream start
+#define IN_STEP_MASKED  0
+
+/// Body shared by every sampling handler: set up the PDC transfers for one
+/// channel, then step to the next. Always inlined with constant arguments,
+/// so each layout and DAC source gets its own branch-free copy.
+static inline __attribute__((always_inline)) void sample_step(const uint8_t out_step,
+                                                              const uint8_t in_step,
+                                                              const bool from_table,
+                                                              const bool decimate,
+                                                              const bool trigger)
+{
+    dma_desc_t * d = &dma_desc[current_chan];
+    if (decimate) {
+        // Both ADCs are shared by the channels, so the other channel's
+        // transfer from the previous invocation has completed by now. A sum
+        // is complete once channel B's last word is in, so it is stored on
+        // the channel A step that starts the next, before that step's own
+        // transfers.
+        dma_desc_t * p = &dma_desc[current_chan ^ 1];
+        p->adc1_sum += __REV16(p->dec_rx[0]);
+        p->adc2_sum += __REV16(p->dec_rx[1]);
+        if(unlikely(++dec_ctr == dec_steps))
+            end_decimated();
     }
+    USART0->US_TPR = (uint32_t)&d->chan_id;
+    USART0->US_TNPR = (uint32_t)d->out;
+    USART1->US_TPR = d->adc1_conf;
+    USART1->US_RPR = decimate ? (uint32_t)&d->dec_rx[0] : (uint32_t)d->adc1_rx;
+    USART2->US_TPR = d->adc2_conf;
+    USART2->US_RPR = decimate ? (uint32_t)&d->dec_rx[1] : (uint32_t)d->adc2_rx;
     
     PIOA->PIO_CODR = N_SYNC;
     USART0->US_TCR = 1;
@@ -197,60 +994,85 @@ void TC2_Handler(void)
     USART2->US_RCR = 2;
     USART2->US_TCR = 2;
     
+    if (trigger) {
+        if (current_chan == trig_chan) {
+            // received by the transfer just started; checked next time
+            trig_word = trig_adc2 ? d->adc2_rx : d->adc1_rx;
+        }
+        else if (trig_status.state == TRIG_ARMED) {
+            uint16_t v = trig_pin ? ((PIOA->PIO_PDSR & trig_pin) ? 0xFFFF : 0)
+                                  : __REV16(*trig_word);
+            v ^= trig_xor;
+            if (unlikely((trig_prev < trig_level) && (v >= trig_level)))
+                fire_trigger();
+            trig_prev = v;
+        }
+    }
     
-    ++sample_ctr;
-    
-    if(sample_ctr == 512)
-    {
-        // Set up for next packet
-        volatile bulk_buffer_t * tmp = active_buffer;
-        active_buffer = comm_buffer;
-        comm_buffer = tmp;
-        
-        current_chan = A;
-        sample_ctr = 0;
-        signal_out = active_buffer->out;
-        meas_v_in = active_buffer->in;
-        if(unlikely(interleave_data))
-            meas_i_in = meas_v_in + 1;
-        else
-            meas_i_in = meas_v_in + CHUNK_SAMPLES;
-        send_in = true;
+    // Set up for the next channel
+    if (from_table) {
+        if (++d->out == d->out_end)
+            d->out = d->out_start;
     }
-    else
-    {
-        // Set up for the next channel
-        if(current_chan == A)
-        {
-            current_chan = B;
-            if(unlikely(interleave_data)) {
-                ++signal_out;
-                meas_v_in += 2;
-                meas_i_in = meas_v_in + 1;
-            }
-            else {
-                signal_out += CHUNK_SAMPLES;
-                meas_v_in += CHUNK_SAMPLES*2;
-                meas_i_in = meas_v_in + CHUNK_SAMPLES;
-            }
+    else {
+        d->out += out_step;
+    }
+    current_chan ^= 1;
+    
+    if (!decimate) {
+        if (in_step == IN_STEP_MASKED) {
+            d->adc1_rx += d->adc1_step;
+            d->adc2_rx += d->adc2_step;
         }
-        else
-        {
-            current_chan = A;
-            if(unlikely(interleave_data)) {
-                ++signal_out;
-                meas_v_in += 2;
-                meas_i_in = meas_v_in + 1;
-            }
-            else {
-                signal_out -= CHUNK_SAMPLES - 1;
-                meas_v_in -= CHUNK_SAMPLES*2 - 1;
-                meas_i_in = meas_v_in + CHUNK_SAMPLES;
-            }
+        else {
+            d->adc1_rx += in_step;
+            d->adc2_rx += in_step;
         }
+        if(unlikely(++sample_ctr == chunk_steps))
+            end_chunk();
     }
-    
-    if(sample_ctr == 254)
-        send_out = true;
 }
 
+/// Instantiate a sampling handler for a layout with the given pointer
+/// increments per sample, in 16-bit words, DAC source, decimation and trigger.
+#define SAMPLING_HANDLER(name, out_step, in_step, from_table, decimate, trigger) \
+    RAMFUNC static void name(void) { sample_step(out_step, in_step, from_table, decimate, trigger); }
+
+SAMPLING_HANDLER(sample_planar, 1, 1, false, false, false)
+SAMPLING_HANDLER(sample_interleaved, 2, 4, false, false, false)
+SAMPLING_HANDLER(play_planar, 1, 1, true, false, false)
+SAMPLING_HANDLER(play_interleaved, 2, 4, true, false, false)
+SAMPLING_HANDLER(sample_masked, 2, IN_STEP_MASKED, false, false, false)
+SAMPLING_HANDLER(play_masked, 0, IN_STEP_MASKED, true, false, false)
+SAMPLING_HANDLER(play_decimated, 0, 0, true, true, false)
+SAMPLING_HANDLER(play_triggered, 0, IN_STEP_MASKED, true, false, true)
+
+/// Runs from SRAM to avoid flash wait states.
+RAMFUNC void TC2_Handler(void)
+{
+    PROFILE_BEGIN(PROF_ISR);
+    // the counter restarts at the RC compare that raised this interrupt
+    uint32_t latency = TC0->TC_CHANNEL[2].TC_CV;
+    if (unlikely(latency > stats.isr_latency_max))
+        stats.isr_latency_max = latency;
+    
+    // clear status register
+    TC0->TC_CHANNEL[2].TC_SR;
+    
+    PIOA->PIO_SODR = N_SYNC;
+    
+    if(streaming) {
+        // pins first, closest to the conversion that raised this interrupt
+        uint16_t * track = dio_track;
+        if (unlikely(track != NULL) && (current_chan == A))
+            capture_dio(track);
+        const uint16_t * pattern = dio_pattern;
+        if (unlikely(pattern != NULL) && (current_chan == B))
+            drive_dio(pattern);
+        sample_handler();
+    }
+    // queued DAC writes follow the sample's frame if there is time
+    if (unlikely(dac_queue_busy))
+        dac_queue_slot();
+    PROFILE_END(PROF_ISR);
+}
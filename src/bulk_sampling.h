@@ -2,14 +2,131 @@
 #ifndef _BULK_SAMPLING_H_
 #define _BULK_SAMPLING_H_
 
-void config_bulk_sampling(uint16_t period, uint16_t sync);
+/// Optional header at the start of each IN packet, enabled with request 0xDE.
+/// Little-endian, unlike the big-endian samples that follow it.
+typedef struct {
+    uint32_t seq;       // chunk sequence number; a gap means chunks were dropped
+    uint16_t frame;     // UDPHS_FNUM (frame<<3 | microframe) when the chunk completed
+    uint16_t flags;     // BULK_HDR_*
+} bulk_header_t;
+
+#define BULK_HDR_OVERRUN    (1<<0)  // chunks before this one were dropped
+#define BULK_HDR_UNDERRUN   (1<<1)  // output replayed the previous OUT chunk
+#define BULK_HDR_TRIGGER    (1<<2)  // the trigger fired during this chunk
+#define BULK_HDR_CALIBRATED (1<<3)  // measurements are calibrated uV and uA
+
+/// Streaming health counters, read and reset with request 0x57.
+typedef struct {
+    uint32_t in_packets;        // IN packets sent to the host
+    uint32_t out_packets;       // OUT packets received from the host
+    uint32_t in_overruns;       // IN chunks dropped because the ring was full
+    uint32_t out_underruns;     // OUT chunks that arrived late; previous chunk replayed
+    uint32_t in_aborts;         // IN transfers completed with a non-OK status
+    uint32_t out_aborts;        // OUT transfers completed with a non-OK status
+    uint32_t isr_latency_max;   // timer ticks (MCK/2) from compare to TC2_Handler entry
+} bulk_stats_t;
+
+/// Measurements carried in IN packets, selected with request 0x73.
+#define BULK_CHAN_V_A       (1<<0)
+#define BULK_CHAN_I_A       (1<<1)
+#define BULK_CHAN_V_B       (1<<2)
+#define BULK_CHAN_I_B       (1<<3)
+#define BULK_CHAN_ALL       0xF
+#define BULK_CHAN_DIO       (1<<4)  // PA0-3 as a nibble track after the measurements
+
+/// Trigger sources for request 0x74; the measurements use BULK_CHAN_* order.
+enum {
+    TRIG_SRC_V_A, TRIG_SRC_I_A, TRIG_SRC_V_B, TRIG_SRC_I_B,
+    TRIG_SRC_PA0, TRIG_SRC_PA1, TRIG_SRC_PA2, TRIG_SRC_PA3,
+    TRIG_SRC_OFF = 0xFF,
+};
+
+/// Trigger progress, reported by request 0x76.
+enum {
+    TRIG_IDLE,      // not triggered capture, or no stream started yet
+    TRIG_ARMED,     // capturing pre-trigger chunks, nothing uploaded
+    TRIG_FIRED,     // trigger seen, finishing the trigger chunk
+    TRIG_POST,      // uploading post-trigger chunks
+    TRIG_DONE,      // window captured, sampling stopped
+};
+
+typedef struct {
+    uint8_t state;      // TRIG_*
+    uint8_t reserved;
+    uint16_t index;     // sample within the trigger chunk
+    uint32_t seq;       // sequence number of the trigger chunk
+    uint16_t pre;       // chunks uploaded before the trigger chunk
+    uint16_t post;      // chunks uploaded after it
+} bulk_trigger_status_t;
+
+/// Bulk transfers are started from the otherwise unused HSMCI interrupt,
+/// pended whenever one may start: a chunk published by TC2_Handler, a
+/// transfer completed, a stream configured. Lowest of all, below the UDPHS
+/// interrupt (ASF's UDD_USB_INT_LEVEL, 5) whose callbacks pend it, so it
+/// runs as soon as they return rather than when the main loop gets there.
+#define BULK_IRQn           HSMCI_IRQn
+#define BULK_Handler        HSMCI_Handler
+#define BULK_IRQ_PRIORITY   15
+
+/// BASEPRI while BULK_Handler submits a transfer: masks the UDPHS interrupt,
+/// where 0xC5 resets the ring, and leaves everything above it running.
+#define BULK_SUBMIT_BASEPRI (5 << (8 - __NVIC_PRIO_BITS))
+
+/// enable BULK_IRQn
+void bulk_sampling_init(void);
+
+/// start sampling at `period`, or stop with period <= 1; false if IN
+/// chunks couldn't be calibrated as fast as they are captured
+bool config_bulk_sampling(uint16_t period, uint16_t sync);
+
+bool bulk_set_chunk_size(uint16_t samples);
 
 void bulk_set_interleave(bool interleave);
 
-void enable_bulk_transfers(void);
+bool bulk_set_header(bool enable);
+
+/// send measurements as calibrated uV and uA rather than ADC codes; needs
+/// a calibration table
+bool bulk_set_calibrated(bool enable);
+
+/// where the data stage of request 0x70 lands; the table can't be played
+/// until bulk_wave_loaded() says it has arrived
+uint8_t * bulk_wave_buffer(uint8_t chan, uint16_t offset, uint16_t bytes);
 
-void handle_bulk_transfers(void);
+void bulk_wave_loaded(uint8_t chan);
+
+bool bulk_set_wave_loop(uint8_t chan, uint16_t samples);
+
+/// where the data stage of request 0x7D lands, as for bulk_wave_buffer()
+uint8_t * bulk_dio_pattern_buffer(uint16_t offset, uint16_t bytes);
+
+void bulk_dio_pattern_loaded(void);
+
+bool bulk_set_dio_output(uint8_t pins, uint16_t loop);
+
+bool bulk_set_decimation(uint16_t ratio);
+
+bool bulk_set_channel_mask(uint8_t mask);
+
+bool bulk_set_trigger(uint8_t source, bool falling, uint16_t level);
+
+bool bulk_set_trigger_window(uint16_t pre_samples, uint16_t post_samples);
+
+void bulk_read_trigger(bulk_trigger_status_t * out);
+
+void enable_bulk_transfers(void);
 
 void poll_trigger(void);
 
+void bulk_read_stats(bulk_stats_t * out, bool reset);
+
+/// true unless a stream is running or about to start
+bool bulk_idle(void);
+
+/// Lend the bottom of the idle sample ring, `bytes` of it, to something else
+/// that receives on the bulk OUT endpoint: any OUT transfer is aborted, and
+/// the ring takes no more until the next stream is configured. NULL while
+/// streaming or if it would reach the waveform tables.
+uint8_t * bulk_borrow_pool(uint32_t bytes);
+
 #endif // _BULK_SAMPLING_H_
@@ -0,0 +1,98 @@
+#include <asf.h>
+#include "calibration.h"
+#include "bulk_sampling.h"
+#include "crc32.h"
+
+static cal_table_t table;       // copy of the newest valid page
+static bool valid;
+static uint8_t page;            // which of the two `table` came from
+static cal_entry_t staged[CAL_PATHS] COMPILER_WORD_ALIGNED;
+
+static uint32_t page_addr(uint8_t p)
+{
+    return IFLASH0_ADDR + (CAL_PAGE_FIRST + p) * IFLASH0_PAGE_SIZE;
+}
+
+static bool check(const cal_table_t * t)
+{
+    return (t->magic == CAL_MAGIC) && (t->crc == crc32(0, t, offsetof(cal_table_t, crc)));
+}
+
+void calibration_init(void)
+{
+    valid = false;
+    for (uint8_t p = 0; p < CAL_PAGES; p++) {
+        const cal_table_t * t = (const cal_table_t *)page_addr(p);
+        if (!check(t))
+            continue;
+        // sequence numbers may wrap, so compare the difference
+        if (valid && (int32_t)(t->sequence - table.sequence) <= 0)
+            continue;
+        memcpy(&table, t, sizeof(table));
+        page = p;
+        valid = true;
+    }
+}
+
+const cal_table_t * calibration_table(void)
+{
+    return valid ? &table : NULL;
+}
+
+uint8_t * calibration_buffer(void)
+{
+    return (uint8_t *)staged;
+}
+
+/// Runs from SRAM, as the IN chunk it converts is due out.
+RAMFUNC void calibration_convert(uint16_t * buf, uint32_t first, uint32_t samples, uint8_t words,
+                                 const cal_entry_t * const * paths)
+{
+    const uint16_t * code = buf + first;
+    int32_t * value = (int32_t *)buf + first;
+    uint32_t i = samples*words;
+    
+    // value i overwrites codes 2i and 2i+1, which are at or after code i
+    while (samples--) {
+        for (uint8_t w = words; w-- > 0; ) {
+            const cal_entry_t * e = paths[w];
+            i--;
+            // Q17.15 keeps a full 16-bit code in range; SMULL with the
+            // Q16.16 gain then gives Q31 of the result
+            int32_t d = (int32_t)(__REV16(code[i]) << 15) - e->offset*128;
+            int32_t gain = (d >= 0) ? e->gain_pos : e->gain_neg;
+            value[i] = (int32_t)(((int64_t)d * gain) >> 31);
+        }
+    }
+}
+
+bool calibration_commit(void)
+{
+    if (!bulk_idle())
+        return false;
+
+    cal_table_t t;
+    t.magic = CAL_MAGIC;
+    t.sequence = valid ? table.sequence + 1 : 1;
+    memcpy(t.path, staged, sizeof(t.path));
+    t.crc = crc32(0, &t, offsetof(cal_table_t, crc));
+
+    // the older copy is overwritten; the current one stays until this checks out
+    uint8_t p = valid ? page ^ 1 : 0;
+    uint32_t addr = page_addr(p);
+
+    // Interrupt handlers run from flash, which stalls while the page is
+    // erased and written, so nothing is taken until it's done.
+    irqflags_t flags = cpu_irq_save();
+    uint32_t rc = flash_unlock(addr, addr + IFLASH0_PAGE_SIZE - 1, NULL, NULL);
+    if (rc == FLASH_RC_OK)
+        rc = flash_write(addr, &t, sizeof(t), 1);
+    cpu_irq_restore(flags);
+
+    if ((rc != FLASH_RC_OK) || memcmp((const void *)addr, &t, sizeof(t)))
+        return false;
+    memcpy(&table, &t, sizeof(table));
+    page = p;
+    valid = true;
+    return true;
+}
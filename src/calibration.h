@@ -0,0 +1,67 @@
+#ifndef _CALIBRATION_H_
+#define _CALIBRATION_H_
+
+#include <asf.h>
+
+/// Per-device calibration kept in the last two flash pages, which flash.ld
+/// leaves out of the firmware image, and read by the host with request 0x7E
+/// at connect time instead of from a file per serial number.
+///
+/// Each write goes to the page not holding the current table, with a higher
+/// sequence number and a CRC-32 over the rest, so a write cut off by a reset
+/// or unplug leaves the previous table in place.
+
+/// flash pages holding the two copies
+#define CAL_PAGE_FIRST      (IFLASH0_SIZE / IFLASH0_PAGE_SIZE - 2)
+#define CAL_PAGES           2
+
+#define CAL_MAGIC           0x314C4143  // "CAL1"
+
+/// Calibrated paths, in the order of the host library's calibration file.
+typedef enum {
+    CAL_A_MEAS_V, CAL_A_MEAS_I, CAL_A_SRC_V, CAL_A_SRC_I,
+    CAL_B_MEAS_V, CAL_B_MEAS_I, CAL_B_SRC_V, CAL_B_SRC_I,
+    CAL_PATHS
+} cal_path_t;
+
+/// One path. For a measurement, value = (code - offset) * gain in uV or uA,
+/// with gain_pos when code >= offset and gain_neg below it. For a source,
+/// code = value / gain + offset, choosing the gain by the sign of value.
+/// Offsets are Q24.8 so midscale, where current reads zero, is in range.
+typedef struct {
+    int32_t offset;     // ADC or DAC code, Q24.8
+    int32_t gain_pos;   // uV or uA per code, Q16.16
+    int32_t gain_neg;
+} cal_entry_t;
+
+/// As stored in flash and returned by request 0x7E. Little-endian.
+typedef struct {
+    uint32_t magic;             // CAL_MAGIC
+    uint32_t sequence;          // one more than the table it replaced
+    cal_entry_t path[CAL_PATHS];
+    uint32_t crc;               // crc32() of everything before it
+} cal_table_t;
+
+/// find the newest valid copy in flash
+void calibration_init(void);
+
+/// the current table, or NULL if neither page holds a valid one
+const cal_table_t * calibration_table(void);
+
+/// where the data stage of request 0x7F lands: CAL_PATHS entries
+uint8_t * calibration_buffer(void);
+
+/// write the entries in calibration_buffer() as the new table; false while
+/// sampling, as flash can't be read while a page is written, or if the page
+/// doesn't read back as written
+bool calibration_commit(void);
+
+/// Expand big-endian ADC codes into measured values in place, as int32 uV or
+/// uA. The codes start at word `first` of `buf` and the values at int32
+/// `first`; there are `samples` samples of `words` codes, calibrated with
+/// paths[0..words-1] in turn. Runs last word first, so a run may be followed
+/// by the codes of later runs, which must already have been converted.
+void calibration_convert(uint16_t * buf, uint32_t first, uint32_t samples, uint8_t words,
+                         const cal_entry_t * const * paths);
+
+#endif // _CALIBRATION_H_
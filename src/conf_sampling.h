@@ -0,0 +1,46 @@
+#ifndef _CONF_SAMPLING_H_
+#define _CONF_SAMPLING_H_
+
+/// Bounds on the depth of the sample ring. The actual depth is however many
+/// slots of the configured chunk size fit in BULK_RING_BYTES; the ISR and
+/// the USB side may each run up to depth-1 packets ahead of the other.
+#define BULK_RING_MIN_SLOTS 4
+#define BULK_RING_MAX_SLOTS 16
+
+/// SRAM budget for the ring. flash.ld's 32K of RAM also holds the 2K stack,
+/// the RAMFUNC sampling handlers, the other statics and ASF's. Those were
+/// estimated from the simulator's objects at about 6K (0.4K more with
+/// PROFILE), not read from a linked map, leaving some 2K spare. The link
+/// fails if they outgrow the region, naming this; `make` prints the
+/// .relocate, .bss and .stack sizes, and the map is left in the build.
+#define BULK_RING_BYTES     (22*1024)
+
+/// Samples per channel per bulk packet, settable with request 0xC6.
+/// The maximum is the largest multiple of 16 that leaves room for
+/// BULK_RING_MIN_SLOTS plain slots beside the waveform tables; wider formats
+/// (header, DIO, 32-bit values) are refused once fewer than that fit.
+#define CHUNK_SAMPLES_DEFAULT   256
+#define CHUNK_SAMPLES_MIN       16
+#define CHUNK_SAMPLES_MAX       448
+
+/// Capacity of each channel's on-device waveform table, in samples.
+/// Both tables are taken from the top of BULK_RING_BYTES while playback is on.
+#define WAVE_TABLE_SAMPLES      1024
+
+/// Capacity of the PA0-3 pattern table loaded with request 0x7D, in samples.
+/// Packed four to a 16-bit word, it lives outside the ring.
+#define DIO_TABLE_SAMPLES       1024
+
+/// Bounds on the decimation ratio set with request 0x72; 1 disables it.
+/// 1024 sums of 16-bit codes need 26 bits, so 32-bit accumulators never wrap.
+#define DECIMATION_MAX          1024
+
+/// Budget checked when 0xC5 starts a calibrated stream (request 0xDF): a
+/// sample's words may take at most a quarter of the 4*period core cycles
+/// that TC2_Handler's two runs for it leave. Both figures are estimates from
+/// the instruction counts, rounded up, not measurements; benchstream on a
+/// PROFILE=1 build reports the real ones as the isr and cal probes.
+#define CAL_CYCLES_PER_WORD     32
+#define SAMPLE_ISR_CYCLES       200
+
+#endif // _CONF_SAMPLING_H_
@@ -0,0 +1,7 @@
+#ifndef CONF_SLEEPMGR_H
+#define CONF_SLEEPMGR_H
+
+// the main loop sleeps between interrupts
+#define CONFIG_SLEEPMGR_ENABLE
+
+#endif // CONF_SLEEPMGR_H
@@ -0,0 +1,11 @@
+#ifndef _CRC32_H_
+#define _CRC32_H_
+
+#include <asf.h>
+
+/// CRC-32 as zlib computes it (reflected, polynomial 0xEDB88320), so hosts
+/// can check against zlib.crc32() or binascii.crc32(). Start with 0 and pass
+/// each result back in to continue over several blocks.
+uint32_t crc32(uint32_t crc, const void * data, uint32_t length);
+
+#endif // _CRC32_H_
@@ -0,0 +1,101 @@
+#include <asf.h>
+#include "conf_board.h"
+#include "dac_queue.h"
+
+typedef struct {
+    uint8_t conf;       // USART0 TPR
+    uint16_t data;      // USART0 TNPR
+} dac_frame_t;
+
+volatile bool dac_queue_busy;
+
+// Ring of frames: submitters add at `tail` with interrupts masked,
+// USART0_Handler sends the one at `head` and retires it once it is out.
+static dac_frame_t queue[DAC_QUEUE_DEPTH];
+static volatile uint8_t head;
+static volatile uint8_t tail;
+static volatile bool active;    // queue[head] is on the wire
+static volatile bool paced;     // TC2 is running and owns USART0 at each compare
+
+/// Send the frame at `head`, with N_SYNC pulsed high to end whatever the
+/// DAC saw before, as TC2_Handler does for a sample.
+static void start(void)
+{
+    dac_frame_t * f = &queue[head];
+    PIOA->PIO_SODR = N_SYNC;
+    USART0->US_TPR = (uint32_t)&f->conf;
+    USART0->US_TNPR = (uint32_t)&f->data;
+    PIOA->PIO_CODR = N_SYNC;
+    USART0->US_TCR = 1;
+    USART0->US_TNCR = 2;
+    active = true;
+}
+
+void USART0_Handler(void)
+{
+    // a sample frame may have gone out since this was raised
+    if (!(USART0->US_CSR & US_CSR_TXEMPTY))
+        return;
+
+    if (active) {
+        PIOA->PIO_SODR = N_SYNC;
+        active = false;
+        head = (head + 1) % DAC_QUEUE_DEPTH;
+    }
+    if (head == tail) {
+        USART0->US_IDR = US_IDR_TXEMPTY;
+        dac_queue_busy = false;
+        return;
+    }
+    if (paced) {
+        // the counter restarts at RC, where TC2_Handler takes the USART back
+        TcChannel * tc = &TC0->TC_CHANNEL[2];
+        if (tc->TC_RC - tc->TC_CV < DAC_FRAME_TICKS) {
+            USART0->US_IDR = US_IDR_TXEMPTY;
+            return;
+        }
+    }
+    start();
+}
+
+void dac_queue_init(void)
+{
+    USART0->US_IDR = US_IDR_TXEMPTY;
+    NVIC_SetPriority(USART0_IRQn, DAC_IRQ_PRIORITY);
+    NVIC_EnableIRQ(USART0_IRQn);
+}
+
+bool dac_queue_write(uint8_t conf, uint16_t data)
+{
+    irqflags_t flags = cpu_irq_save();
+    uint8_t next = (tail + 1) % DAC_QUEUE_DEPTH;
+    // Full: don't wait for USART0_Handler, as while a short-period stream
+    // runs it never finds a gap, and the UDPHS interrupt calling this
+    // would spin until the watchdog fires.
+    if (next == head) {
+        cpu_irq_restore(flags);
+        return false;
+    }
+    queue[tail].conf = conf;
+    queue[tail].data = data;
+    tail = next;
+    dac_queue_busy = true;
+    USART0->US_IER = US_IER_TXEMPTY;
+    cpu_irq_restore(flags);
+    return true;
+}
+
+/// Called from TC2_Handler when a triggered capture ends, so runs from SRAM.
+RAMFUNC void dac_queue_pace(bool p)
+{
+    paced = p;
+    if (!p && dac_queue_busy)
+        USART0->US_IER = US_IER_TXEMPTY;
+}
+
+RAMFUNC void dac_queue_slot(void)
+{
+    // a frame cut off by this sample's N_SYNC is sent again in a later gap
+    active = false;
+    USART0->US_IER = US_IER_TXEMPTY;
+}
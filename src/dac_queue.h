@@ -0,0 +1,39 @@
+#ifndef _DAC_QUEUE_H_
+#define _DAC_QUEUE_H_
+
+#include <asf.h>
+
+/// Queued AD5663 command frames. USART0 carries a DAC word from TC2_Handler
+/// every sample, so configuration writes are sent from USART0_Handler when
+/// the USART goes idle: straight away while the sampling timer is stopped,
+/// otherwise in the gap after a sample's frame if it is long enough.
+
+/// Frames queued at once. A full queue refuses further writes.
+#define DAC_QUEUE_DEPTH     8
+
+/// Above TWI0 and UDPHS so the gap after a sample frame isn't missed, below TC2.
+#define DAC_IRQ_PRIORITY    1
+
+/// TC0 ticks (48MHz) a frame needs before the next sample: 24 bits at the
+/// 24MHz SPI clock, plus margin for starting it. At 0xC5 periods too short to
+/// leave this after the sample's own frame, writes wait for the stream to stop,
+/// and once DAC_QUEUE_DEPTH-1 are waiting the next is refused.
+#define DAC_FRAME_TICKS     72
+
+/// true while a frame is queued or in flight; read by TC2_Handler
+extern volatile bool dac_queue_busy;
+
+/// enable the interrupt; after USART0 is configured
+void dac_queue_init(void);
+
+/// queue a command byte and data word, sent in memory order as by the PDC;
+/// false if the queue is full
+bool dac_queue_write(uint8_t conf, uint16_t data);
+
+/// the sampling timer started or stopped; while it runs frames go in its gaps
+void dac_queue_pace(bool paced);
+
+/// from TC2_Handler after it starts a sample frame, while dac_queue_busy
+void dac_queue_slot(void);
+
+#endif // _DAC_QUEUE_H_
@@ -0,0 +1,155 @@
+#include <asf.h>
+#include "iap.h"
+#include "bulk_sampling.h"
+#include "crc32.h"
+
+static volatile iap_status_t status;
+static uint8_t * chunk;                 // borrowed from the sample ring
+static volatile bool armed;             // a bulk OUT transfer is pending
+static volatile bool chunk_ready;       // and now it has finished
+static volatile bool chunk_ok;
+static volatile uint32_t chunk_bytes;
+
+static void fail(iap_error_t error)
+{
+    status.error = error;
+    status.state = IAP_FAILED;
+}
+
+/// bytes the next transfer should bring
+static uint32_t chunk_due(void)
+{
+    return Min(IAP_CHUNK_BYTES, status.length - status.received);
+}
+
+static void out_received(udd_ep_status_t s, iram_size_t nb_transfered, udd_ep_id_t ep)
+{
+    UNUSED(ep);
+    armed = false;
+    chunk_ok = (s == UDD_EP_TRANSFER_OK);
+    chunk_bytes = nb_transfered;
+    chunk_ready = true;
+}
+
+bool iap_begin(uint32_t length)
+{
+    if ((length > IAP_IMAGE_MAX) || (status.state == IAP_INSTALLING))
+        return false;
+    if (length == 0) {
+        if (armed)
+            udd_ep_abort(UDI_VENDOR_EP_BULK_OUT);
+        status = (iap_status_t){0};
+        return true;
+    }
+    // aborts any OUT transfer, ours included, before the state is reset
+    uint8_t * buf = bulk_borrow_pool(IAP_CHUNK_BYTES);
+    if (!buf)
+        return false;
+    chunk = buf;
+    chunk_ready = false;
+    status = (iap_status_t){ .state = IAP_RECEIVING, .length = length };
+    return true;
+}
+
+bool iap_busy(void)
+{
+    return (status.state == IAP_RECEIVING) || (status.state == IAP_INSTALLING);
+}
+
+void iap_read_status(iap_status_t * out)
+{
+    irqflags_t flags = cpu_irq_save();
+    *out = status;
+    cpu_irq_restore(flags);
+}
+
+bool iap_install(uint32_t crc)
+{
+    if (status.state != IAP_RECEIVED)
+        return false;
+    if (crc != status.crc) {
+        fail(IAP_ERR_CRC);
+        return false;
+    }
+    status.state = IAP_INSTALLING;
+    return true;
+}
+
+/// Copy the staged image over the running one and reset into it. Runs from
+/// SRAM with interrupts off, as the flash it came from is being replaced, so
+/// it drives the EEFC itself rather than through flash_efc. GPNVM bit 1 is
+/// set again only if every page reads back.
+RAMFUNC __attribute__((noreturn)) static void copy_image(uint32_t pages)
+{
+    uint32_t * dst = (uint32_t *)IFLASH0_ADDR;
+    const uint32_t * src = (const uint32_t *)IAP_STAGING_ADDR;
+    const uint32_t words = pages*IFLASH0_PAGE_SIZE/4;
+
+    for (uint32_t p = 0; p < pages; p++) {
+        // fill the page latch through the page's own addresses, then write it
+        for (uint32_t i = 0; i < IFLASH0_PAGE_SIZE/4; i++)
+            dst[p*IFLASH0_PAGE_SIZE/4 + i] = src[p*IFLASH0_PAGE_SIZE/4 + i];
+        EFC0->EEFC_FCR = EEFC_FCR_FKEY(0x5A) | EEFC_FCR_FARG(p) | EEFC_FCR_FCMD(EFC_FCMD_EWP);
+        while (!(EFC0->EEFC_FSR & EEFC_FSR_FRDY));
+        WDT->WDT_CR = WDT_CR_KEY(0xA5) | WDT_CR_WDRSTT;
+    }
+    bool ok = true;
+    for (uint32_t i = 0; i < words; i++)
+        ok &= (dst[i] == src[i]);
+    if (ok) {
+        EFC0->EEFC_FCR = EEFC_FCR_FKEY(0x5A) | EEFC_FCR_FARG(1) | EEFC_FCR_FCMD(EFC_FCMD_SGPB);
+        while (!(EFC0->EEFC_FSR & EEFC_FSR_FRDY));
+    }
+    NVIC_SystemReset();
+}
+
+static void install(void)
+{
+    uint32_t pages = (status.length + IFLASH0_PAGE_SIZE - 1) / IFLASH0_PAGE_SIZE;
+
+    // let the status stage of 0xB3 reach the host before leaving the bus
+    cpu_delay_us(2000, F_CPU);
+    udc_detach();
+    flash_unlock(IFLASH0_ADDR, IFLASH0_ADDR + pages*IFLASH0_PAGE_SIZE - 1, NULL, NULL);
+    cpu_irq_disable();
+    // from here a reset boots the SAM-BA ROM until the copy checks out
+    flash_clear_gpnvm(1);
+    copy_image(pages);
+}
+
+void iap_poll(void)
+{
+    if (status.state == IAP_INSTALLING)
+        install();
+    if (status.state != IAP_RECEIVING)
+        return;
+    if (!chunk_ready) {
+        if (!armed)
+            armed = udi_vendor_bulk_out_run(chunk, chunk_due(), out_received);
+        return;
+    }
+    chunk_ready = false;
+    if (!chunk_ok || (chunk_bytes != chunk_due())) {
+        fail(IAP_ERR_TRANSFER);
+        return;
+    }
+
+    // Interrupt handlers run from flash, which stalls while pages are
+    // erased and written, so nothing is taken until they're done.
+    uint32_t addr = IAP_STAGING_ADDR + status.received;
+    irqflags_t flags = cpu_irq_save();
+    uint32_t rc = flash_unlock(addr, addr + chunk_bytes - 1, NULL, NULL);
+    if (rc == FLASH_RC_OK)
+        rc = flash_write(addr, chunk, chunk_bytes, 1);
+    cpu_irq_restore(flags);
+    if ((rc != FLASH_RC_OK) || memcmp((const void *)addr, chunk, chunk_bytes)) {
+        fail(IAP_ERR_FLASH);
+        return;
+    }
+
+    status.received += chunk_bytes;
+    if (status.received == status.length) {
+        status.crc = crc32(0, (const void *)IAP_STAGING_ADDR, status.length);
+        status.state = IAP_RECEIVED;
+    }
+}
@@ -0,0 +1,66 @@
+#ifndef _IAP_H_
+#define _IAP_H_
+
+#include <asf.h>
+#include "calibration.h"
+
+/// In-application firmware update. Request 0xB1 announces an image, which
+/// then arrives on the bulk OUT endpoint in IAP_CHUNK_BYTES transfers and is
+/// written to a staging area in the upper half of flash. Request 0xB3 checks
+/// it against the host's CRC-32 and only then is it copied over the running
+/// image, from SRAM, and the device reset into it.
+///
+/// A transfer that fails or is abandoned leaves the running image alone.
+/// GPNVM bit 1 is cleared for the copy, as by request 0xBB, so a reset or
+/// power loss part way boots the SAM-BA ROM rather than half an image.
+
+/// Largest image: half the flash below the calibration pages. flash.ld
+/// limits the firmware to the lower half, and the upper half stages updates.
+#define IAP_IMAGE_MAX       ((IFLASH0_SIZE - CAL_PAGES*IFLASH0_PAGE_SIZE) / 2)
+#define IAP_STAGING_ADDR    (IFLASH0_ADDR + IAP_IMAGE_MAX)
+
+/// Bytes per bulk OUT transfer, received into the idle sample ring
+#define IAP_CHUNK_BYTES     2048
+
+typedef enum {
+    IAP_IDLE,
+    IAP_RECEIVING,      // image arriving on the bulk OUT endpoint
+    IAP_RECEIVED,       // staged; waiting for 0xB3
+    IAP_FAILED,
+    IAP_INSTALLING,     // copying, then reset
+} iap_state_t;
+
+typedef enum {
+    IAP_OK,
+    IAP_ERR_TRANSFER,   // a bulk OUT transfer was aborted or short
+    IAP_ERR_FLASH,      // a staging page didn't read back as written
+    IAP_ERR_CRC,        // 0xB3 gave a different CRC
+} iap_error_t;
+
+/// Progress of an update, request 0xB2. Little-endian.
+typedef struct {
+    uint8_t state;      // iap_state_t
+    uint8_t error;      // iap_error_t, once IAP_FAILED
+    uint16_t reserved;
+    uint32_t length;    // announced by 0xB1
+    uint32_t received;  // bytes staged so far
+    uint32_t crc;       // crc32() of the staged image, once IAP_RECEIVED
+} iap_status_t;
+
+/// start receiving an image of `length` bytes, or cancel with 0; false
+/// while sampling, during an install, or if it is too large
+bool iap_begin(uint32_t length);
+
+/// true while an image is arriving or being installed
+bool iap_busy(void);
+
+void iap_read_status(iap_status_t * out);
+
+/// install the staged image if its CRC is `crc`; the main loop then copies
+/// it and resets
+bool iap_install(uint32_t crc);
+
+/// from the main loop: stage received chunks, and install
+void iap_poll(void);
+
+#endif // _IAP_H_
@@ -2,6 +2,9 @@
 #include <asf.h>
 #include "init.h"
 #include "conf_board.h"
+#include "twi_queue.h"
+#include "dac_queue.h"
+#include "bulk_sampling.h"
 
 // *************************************************************************************************
 // Types
@@ -48,7 +51,7 @@ static usart_spi_opt_t USART_SPI_DAC =
 static twi_options_t TWIM_CONFIG =
 {
     .master_clk = F_CPU,
-    .speed = 100000,
+    .speed = 400000,
     .chip = 0,
     .smbus = 0,
 };
@@ -183,12 +186,14 @@ void init_hardware(void) {
     USART0->US_PTCR = US_PTCR_TXTEN;
     USART1->US_PTCR = US_PTCR_TXTEN | US_PTCR_RXTEN;
     USART2->US_PTCR = US_PTCR_TXTEN | US_PTCR_RXTEN;
+    dac_queue_init();
     
     
-// 100khz I2C
+// 400khz I2C, driven from TWI0_Handler through twi_queue.c
     twi_reset(TWI0);
     twi_enable_master_mode(TWI0);
     twi_master_init(TWI0, &TWIM_CONFIG);
+    twi_queue_init();
     
     
 // CLOCK1 = MCLK/2
@@ -202,6 +207,7 @@ void init_hardware(void) {
 // CPAS doesn't matter, CPCS is triggered post-conversion
     tc_enable_interrupt(TC0, 2, TC_IER_CPCS);
     NVIC_EnableIRQ(TC2_IRQn);
+    bulk_sampling_init();
     
     
 // set RGB LED to hue generated from UID
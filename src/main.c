@@ -5,6 +5,10 @@
 #include "init.h"
 #include "board_io.h"
 #include "bulk_sampling.h"
+#include "profile.h"
+#include "power_monitor.h"
+#include "calibration.h"
+#include "iap.h"
 
 #include "conf_usb.h"
 #include "conf_board.h"
@@ -20,8 +24,15 @@ static const char fwversion[] = xstringify(FW_VERSION);
 
 static volatile bool reset;
 static bool main_b_vendor_enable;
+static bool bus_awake;          // SOFs are arriving
 
-static uint8_t ret_data[64];
+static uint8_t ret_data[64] COMPILER_WORD_ALIGNED;
+
+// Command list (request 0x78): the data stage lands in cmd_list, and each
+// entry's cmd_status_t is kept for request 0x79.
+static cmd_entry_t cmd_list[CMD_LIST_MAX] COMPILER_WORD_ALIGNED;
+static uint8_t cmd_status[CMD_LIST_MAX];
+static uint8_t cmd_count;
 
 static USB_MicrosoftCompatibleDescriptor msft_compatible = {
     .dwLength = sizeof(USB_MicrosoftCompatibleDescriptor) +
@@ -41,8 +52,6 @@ static USB_MicrosoftCompatibleDescriptor msft_compatible = {
     }
 };
 
-// uint16_t cal_data[IFLASH0_PAGE_SIZE/sizeof(uint16_t)];
-
 
 // *************************************************************************************************
 // Functions
@@ -59,6 +68,15 @@ int main(void)
     wdt_init(WDT, WDT_MR_WDRSTEN, 50, 50);
     // setup peripherals
     init_hardware();
+    // before USB, so request 0x7E answers from the start
+    calibration_init();
+    // The main loop sleeps no deeper than WFI, as wait mode stops the
+    // clocks sampling runs on, and not at all until SOFs arrive: the
+    // watchdog runs on while the core sleeps, and only SOFs are sure to
+    // wake it in time.
+    sleepmgr_init();
+    sleepmgr_lock_mode(SLEEPMGR_SLEEP_WFI);
+    sleepmgr_lock_mode(SLEEPMGR_ACTIVE);
     // start USB
     cpu_delay_us(100, F_CPU);
 
@@ -69,23 +87,42 @@ int main(void)
     udc_attach();
     
     board_io_init();
+    profile_init();
+    power_monitor_init();
 
+    // Bulk transfers run from BULK_IRQn, and control requests from the
+    // UDPHS interrupt; what's left here is woken by whichever interrupt
+    // gives it work, or the next SOF.
     while (true) {
-        handle_bulk_transfers();
+        PROFILE_LAP(PROF_LOOP);
+        iap_poll();
         if (!reset)
             wdt_restart(WDT);
         else
             udc_detach();
+        sleepmgr_enter_sleep();
     }
 }
 
-void main_suspend_action(void) { }
+void main_suspend_action(void) {
+    if (bus_awake) {
+        bus_awake = false;
+        sleepmgr_lock_mode(SLEEPMGR_ACTIVE);
+    }
+}
 
 void main_resume_action(void) { }
 
 void main_sof_action(void) {
+    if (!bus_awake) {
+        bus_awake = true;
+        sleepmgr_unlock_mode(SLEEPMGR_ACTIVE);
+    }
+    PROFILE_BEGIN(PROF_SOF);
     frame_number = UDPHS->UDPHS_FNUM;
     poll_trigger();
+    power_monitor_sof(frame_number);
+    PROFILE_END(PROF_SOF);
     if (!main_b_vendor_enable)// FIXME: this code does nothing
         return;
 }
@@ -143,6 +180,151 @@ bool msft_string_handle(void) {
     return true;
 }
 
+/// Run one of the requests that only set state: no data stage in either
+/// direction. Shared by main_setup_handle() and the 0x78 command list.
+static cmd_status_t run_command(uint8_t request, uint16_t value, uint16_t index) {
+    switch (request) {
+        /// Set pin 0
+        case 0x50: {
+            int32_t low = value & 0x1F;
+            bool PB = value > 0x1F;
+            pio_set_output(PB ? PIOB: PIOA, 1<<low, LOW, DISABLE, DISABLE);
+            break;
+        }
+        /// Set pin 1
+        case 0x51: {
+            int32_t low = value & 0x1F;
+            bool PB = value > 0x1F;
+            pio_set_output(PB ? PIOB: PIOA, 1<<low, HIGH, DISABLE, DISABLE);
+            break;
+        }
+        /// set channel mode - wValue = channel, wIndex = value
+        case 0x53: {
+            if (!set_mode(value&0xF, index&0xF))
+                return CMD_REJECTED;
+            break;
+        }
+        /// set potentiometer - wValue = channel, wIndex = values (0xAABB)
+        case 0x59: {
+            write_ad5122((value&0xF), (index&0xFF00)>>8, (index&0xFF));
+            break;
+        }
+        /// setup hardware
+        case 0xCC: {
+            if (!config_hardware())
+                return CMD_REJECTED;
+            break;
+        }
+        /// Change interleave mode
+        case 0xDD: {
+            bulk_set_interleave(value & 1);
+            break;
+        }
+        /// Enable or disable the IN packet header, wValue = 1 to enable
+        case 0xDE: {
+            if (!bulk_set_header(value & 1))
+                return CMD_REJECTED;
+            break;
+        }
+        /// Send calibrated uV and uA rather than ADC codes, wValue = 1 to enable
+        case 0xDF: {
+            if (!bulk_set_calibrated(value & 1))
+                return CMD_REJECTED;
+            break;
+        }
+        /// configure sampling
+        case 0xC5: {
+            if ((iap_busy() && (value > 1)) || !config_bulk_sampling(value, index))
+                return CMD_REJECTED;
+            break;
+        }
+        /// set samples per channel per bulk packet, applied at the next 0xC5
+        case 0xC6: {
+            if (!bulk_set_chunk_size(value))
+                return CMD_REJECTED;
+            break;
+        }
+        /// set waveform loop length - wValue = channel, wIndex = samples, 0 to stream
+        case 0x71: {
+            if (!bulk_set_wave_loop(value&0xF, index))
+                return CMD_REJECTED;
+            break;
+        }
+        /// set decimation ratio, wValue = ratio, 1 to disable; needs playback
+        case 0x72: {
+            if (!bulk_set_decimation(value))
+                return CMD_REJECTED;
+            break;
+        }
+        /// set IN channel mask, wValue = BULK_CHAN_* bits
+        case 0x73: {
+            if (!bulk_set_channel_mask(value))
+                return CMD_REJECTED;
+            break;
+        }
+        /// set trigger - wValue = level, wIndex = source | falling<<8, source 0xFF = off
+        case 0x74: {
+            if (!bulk_set_trigger(index&0xFF, (index>>8)&1, value))
+                return CMD_REJECTED;
+            break;
+        }
+        /// set trigger window - wValue = pre-trigger samples, wIndex = post-trigger samples
+        case 0x75: {
+            if (!bulk_set_trigger_window(value, index))
+                return CMD_REJECTED;
+            break;
+        }
+        /// drive PA0-3 each sample - wValue = pins, wIndex = pattern table
+        /// loop in samples, 0 for the pattern in the OUT stream
+        case 0x7C: {
+            if (!bulk_set_dio_output(value & 0xFF, index))
+                return CMD_REJECTED;
+            break;
+        }
+        /// ADM1177 background reading interval - wValue = ms, 0 to stop
+        case 0x7A: {
+            power_monitor_set_interval(value);
+            break;
+        }
+        default:
+            return CMD_UNKNOWN;
+    }
+    return CMD_OK;
+}
+
+/// Data stage of request 0x78 has arrived: run the list in order, stopping
+/// at the first command that fails.
+static void run_command_list(void) {
+    uint8_t n = udd_g_ctrlreq.payload_size / sizeof(cmd_entry_t);
+    cmd_status_t status = CMD_OK;
+
+    for (uint8_t i = 0; i < n; i++) {
+        const cmd_entry_t * c = &cmd_list[i];
+        if (status == CMD_OK)
+            status = run_command(c->request, c->value, c->index);
+        else
+            status = CMD_SKIPPED;
+        cmd_status[i] = status;
+    }
+    cmd_count = n;
+}
+
+/// Data stage of request 0x70 has arrived: the table can be played.
+static void wave_loaded(void) {
+    bulk_wave_loaded(udd_g_ctrlreq.req.wValue&0xF);
+}
+
+/// Data stage of request 0x7D has arrived.
+static void dio_pattern_loaded(void) {
+    bulk_dio_pattern_loaded();
+}
+
+/// Data stage of request 0x7F has arrived; read the table back with 0x7E
+/// to see whether it was written.
+static void write_calibration(void) {
+    calibration_commit();
+}
+
 /// handle control transfers
 bool main_setup_handle(void) {
     uint8_t* ptr = 0;
@@ -162,27 +344,15 @@ bool main_setup_handle(void) {
                 }
                 break;
             }
-            /// read ADM1177
+            /// read ADM1177 - up to the 3 bytes of the latest background
+            /// reading; stalls before the first
             case 0x17: {
-                size = udd_g_ctrlreq.req.wIndex&0xFF;
-                read_adm1177((uint8_t*)(&ret_data), size);
+                size = Min(udd_g_ctrlreq.req.wIndex&0xFF, 3);
+                if (!power_monitor_raw((uint8_t*)(&ret_data), size))
+                    return false;
                 ptr = (uint8_t*)&ret_data;
                 break;
             }
-            /// Set pin 0
-            case 0x50: {
-                int32_t low = udd_g_ctrlreq.req.wValue & 0x1F;
-                bool PB = udd_g_ctrlreq.req.wValue > 0x1F;
-                pio_set_output(PB ? PIOB: PIOA, 1<<low, LOW, DISABLE, DISABLE);
-                break;
-            }
-            /// Set pin 1
-            case 0x51: {
-                int32_t low = udd_g_ctrlreq.req.wValue & 0x1F;
-                bool PB = udd_g_ctrlreq.req.wValue > 0x1F;
-                pio_set_output(PB ? PIOB: PIOA, 1<<low, HIGH, DISABLE, DISABLE);
-                break;
-            }
             /// Set pin input, get pin value
             case 0x91: {
                 int32_t low = udd_g_ctrlreq.req.wValue & 0x1F;
@@ -193,32 +363,31 @@ bool main_setup_handle(void) {
                 size = 1;
                 break;
             }
-            /// set channel mode - wValue = channel, wIndex = value
-            case 0x53: {
-                set_mode(udd_g_ctrlreq.req.wValue&0xF, udd_g_ctrlreq.req.wIndex&0xF);
-                break;
-            }
-            /// set potentiometer - wValue = channel, wIndex = values (0xAABB)
-            case 0x59: {
-                write_ad5122((udd_g_ctrlreq.req.wValue&0xF),
-                             (udd_g_ctrlreq.req.wIndex&0xFF00)>>8,
-                             (udd_g_ctrlreq.req.wIndex&0xFF));
-                break;
-            }
             /// erase and reset to bootloader
             case 0xBB: {
                 flash_clear_gpnvm(1);
                 reset = true;
                 break;
             }
-            /// setup hardware
-            case 0xCC: {
-                config_hardware();
+            /// start a firmware update of wIndex<<16 | wValue bytes, then sent
+            /// on the bulk OUT endpoint; 0 cancels. Stalls while streaming
+            case 0xB1: {
+                if (!iap_begin((uint32_t)udd_g_ctrlreq.req.wIndex << 16 | udd_g_ctrlreq.req.wValue))
+                    return false;
                 break;
             }
-            /// Change interleave mode
-            case 0xDD: {
-                bulk_set_interleave(udd_g_ctrlreq.req.wValue & 1);
+            /// read firmware update progress
+            case 0xB2: {
+                iap_read_status((iap_status_t *)&ret_data);
+                ptr = (uint8_t*)&ret_data;
+                size = sizeof(iap_status_t);
+                break;
+            }
+            /// install the received image and reset into it, wIndex<<16 | wValue
+            /// = its CRC-32; stalls unless it has all arrived with that CRC
+            case 0xB3: {
+                if (!iap_install((uint32_t)udd_g_ctrlreq.req.wIndex << 16 | udd_g_ctrlreq.req.wValue))
+                    return false;
                 break;
             }
             /// get USB microframe
@@ -229,9 +398,94 @@ bool main_setup_handle(void) {
                 size = 2;
                 break;
             }
-            /// configure sampling
-            case 0xC5: {
-                config_bulk_sampling(udd_g_ctrlreq.req.wValue, udd_g_ctrlreq.req.wIndex);
+            /// read streaming statistics, wValue = 1 to reset them afterwards
+            case 0x57: {
+                bulk_read_stats((bulk_stats_t *)&ret_data, udd_g_ctrlreq.req.wValue & 1);
+                ptr = (uint8_t*)&ret_data;
+                size = sizeof(bulk_stats_t);
+                break;
+            }
+            /// load waveform table - wValue = channel, wIndex = first sample,
+            /// data = big-endian DAC words as in the OUT stream
+            case 0x70: {
+                if (!Udd_setup_is_out())
+                    return false;
+                ptr = bulk_wave_buffer(udd_g_ctrlreq.req.wValue&0xF, udd_g_ctrlreq.req.wIndex,
+                                       udd_g_ctrlreq.req.wLength);
+                if (!ptr)
+                    return false;
+                size = udd_g_ctrlreq.req.wLength;
+                udd_g_ctrlreq.callback = wave_loaded;
+                break;
+            }
+            /// load PA0-3 pattern table - wIndex = first sample, data = two samples per byte
+            case 0x7D: {
+                if (!Udd_setup_is_out())
+                    return false;
+                ptr = bulk_dio_pattern_buffer(udd_g_ctrlreq.req.wIndex, udd_g_ctrlreq.req.wLength);
+                if (!ptr)
+                    return false;
+                size = udd_g_ctrlreq.req.wLength;
+                udd_g_ctrlreq.callback = dio_pattern_loaded;
+                break;
+            }
+            /// read trigger status
+            case 0x76: {
+                bulk_read_trigger((bulk_trigger_status_t *)&ret_data);
+                ptr = (uint8_t*)&ret_data;
+                size = sizeof(bulk_trigger_status_t);
+                break;
+            }
+            /// read cycle profile - wIndex = probe, wValue = 1 to reset it afterwards;
+            /// stalls unless built with PROFILE=1
+            case 0x77: {
+                if (!profile_read(udd_g_ctrlreq.req.wIndex&0xFF, (profile_record_t *)&ret_data,
+                                  udd_g_ctrlreq.req.wValue & 1))
+                    return false;
+                ptr = (uint8_t*)&ret_data;
+                size = sizeof(profile_record_t);
+                break;
+            }
+            /// read cached ADM1177 readings, wValue = 1 to reset the window afterwards
+            case 0x7B: {
+                power_monitor_read((power_reading_t *)&ret_data, udd_g_ctrlreq.req.wValue & 1);
+                ptr = (uint8_t*)&ret_data;
+                size = sizeof(power_reading_t);
+                break;
+            }
+            /// read the calibration table; stalls if neither flash page holds one
+            case 0x7E: {
+                ptr = (uint8_t*)calibration_table();
+                if (!ptr)
+                    return false;
+                size = sizeof(cal_table_t);
+                break;
+            }
+            /// write the calibration table - data = cal_entry_t for each path,
+            /// written to flash once it has arrived; stalls while streaming
+            case 0x7F: {
+                size = udd_g_ctrlreq.req.wLength;
+                if (!Udd_setup_is_out() || size != CAL_PATHS*sizeof(cal_entry_t) || !bulk_idle())
+                    return false;
+                ptr = calibration_buffer();
+                udd_g_ctrlreq.callback = write_calibration;
+                break;
+            }
+            /// run a command list - data = cmd_entry_t[], run once it has arrived
+            case 0x78: {
+                size = udd_g_ctrlreq.req.wLength;
+                if (!Udd_setup_is_out() || size == 0 || size > sizeof(cmd_list) ||
+                    size % sizeof(cmd_entry_t))
+                    return false;
+                ptr = (uint8_t*)cmd_list;
+                cmd_count = 0;
+                udd_g_ctrlreq.callback = run_command_list;
+                break;
+            }
+            /// read the status of each command in the last list
+            case 0x79: {
+                ptr = (uint8_t*)cmd_status;
+                size = cmd_count;
                 break;
             }
             /// windows compatible ID handling for autoinstall
@@ -248,6 +502,12 @@ bool main_setup_handle(void) {
                 }
                 break;
             }
+            default: {
+                if (run_command(udd_g_ctrlreq.req.bRequest, udd_g_ctrlreq.req.wValue,
+                                udd_g_ctrlreq.req.wIndex) == CMD_REJECTED)
+                    return false;
+                break;
+            }
         }
     }
     udd_g_ctrlreq.payload_size = size;
@@ -260,4 +520,3 @@ bool main_setup_handle(void) {
     }
     return true;
 }
-
@@ -7,10 +7,27 @@
 #define xstringify(s) stringify(s)
 #define SWAP16(x)        ((((x) & 0xff00)>> 8) | (((x) & 0x00ff) << 8))
 
-// #define cal_table_base = 0x00080000 + 256*254;
-
 extern uint32_t frame_number;
 
+/// One entry of a command list, request 0x78: a request with no data stage,
+/// as its setup packet would carry it. Little-endian.
+typedef struct {
+    uint8_t request;
+    uint16_t value;
+    uint16_t index;
+} __attribute__((packed)) cmd_entry_t;
+
+/// Most entries in one command list
+#define CMD_LIST_MAX 32
+
+/// Per-entry result, read back with request 0x79
+typedef enum {
+    CMD_OK = 0,
+    CMD_REJECTED = 1,   // the request would have stalled
+    CMD_UNKNOWN = 2,    // not a request that can be listed
+    CMD_SKIPPED = 3,    // not run, as an earlier entry failed
+} cmd_status_t;
+
 bool main_vendor_enable(void);
 
 void main_vendor_disable(void);
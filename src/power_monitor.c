@@ -0,0 +1,85 @@
+#include <asf.h>
+#include "power_monitor.h"
+#include "twi_queue.h"
+
+// 7b addr of '1177 w/ addr p grounded
+#define ADM1177_ADDR    0x58
+
+static power_reading_t cache;
+static uint8_t raw[3];          // V[11:4], I[11:4], V[3:0]:I[3:0]
+static uint8_t rx[3];           // filled by the TWI queue
+static bool valid;
+static volatile bool pending;   // a read is queued or in progress
+static uint16_t interval = POWER_DEFAULT_INTERVAL;
+static uint16_t elapsed;
+
+static void reset_window(void)
+{
+    cache.v_min = cache.i_min = 0xFFFF;
+    cache.v_max = cache.i_max = 0;
+    cache.count = 0;
+    cache.errors = 0;
+}
+
+/// Called from TWI0_Handler with the three bytes of a reading.
+static void reading_done(bool ok, void * ctx)
+{
+    pending = false;
+    if (!ok) {
+        cache.errors++;
+        return;
+    }
+    memcpy(raw, rx, sizeof(raw));
+    valid = true;
+    cache.v = rx[0] << 4 | rx[2] >> 4;
+    cache.i = rx[1] << 4 | (rx[2] & 0xF);
+    cache.v_min = Min(cache.v_min, cache.v);
+    cache.v_max = Max(cache.v_max, cache.v);
+    cache.i_min = Min(cache.i_min, cache.i);
+    cache.i_max = Max(cache.i_max, cache.i);
+    cache.count++;
+    cache.frame = UDPHS->UDPHS_FNUM;
+}
+
+void power_monitor_init(void)
+{
+    reset_window();
+    elapsed = 0;
+}
+
+void power_monitor_set_interval(uint16_t ms)
+{
+    interval = ms;
+    elapsed = 0;
+}
+
+void power_monitor_sof(uint16_t fnum)
+{
+    // once per 1ms frame; microframe 0 at high speed
+    if ((fnum & UDPHS_FNUM_MICRO_FRAME_NUM_Msk) || !interval)
+        return;
+    if (++elapsed < interval || pending)
+        return;
+    elapsed = 0;
+    pending = true;
+    twi_queue_read(ADM1177_ADDR, rx, sizeof(rx), reading_done, NULL);
+}
+
+bool power_monitor_raw(uint8_t * out, uint8_t length)
+{
+    irqflags_t flags = cpu_irq_save();
+    bool ok = valid;
+    for (uint8_t i = 0; i < length; i++)
+        out[i] = (i < sizeof(raw)) ? raw[i] : 0;
+    cpu_irq_restore(flags);
+    return ok;
+}
+
+void power_monitor_read(power_reading_t * out, bool reset)
+{
+    irqflags_t flags = cpu_irq_save();
+    *out = cache;
+    if (reset)
+        reset_window();
+    cpu_irq_restore(flags);
+}
@@ -0,0 +1,42 @@
+#ifndef _POWER_MONITOR_H_
+#define _POWER_MONITOR_H_
+
+#include <asf.h>
+
+/// Background readings of USB bus voltage and current from the ADM1177,
+/// taken through the TWI queue every few milliseconds of SOFs, so requests
+/// 0x17 and 0x7B answer from the cache without touching the bus.
+
+/// ms between readings until request 0x7A changes it
+#define POWER_DEFAULT_INTERVAL  10
+
+/// Cached readings, request 0x7B. Little-endian; V and I are the ADM1177's
+/// 12-bit codes.
+typedef struct {
+    uint16_t v;             // latest reading
+    uint16_t i;
+    uint16_t v_min;         // since the last reset; 0xFFFF until a reading
+    uint16_t v_max;
+    uint16_t i_min;
+    uint16_t i_max;
+    uint32_t count;         // readings since the last reset
+    uint16_t errors;        // reads the ADM1177 didn't acknowledge
+    uint16_t frame;         // UDPHS_FNUM when the latest reading arrived
+} power_reading_t;
+
+/// clear the window and start reading at the default interval
+void power_monitor_init(void);
+
+/// ms between readings, 0 to stop
+void power_monitor_set_interval(uint16_t ms);
+
+/// from main_sof_action(); queues a reading when one is due
+void power_monitor_sof(uint16_t fnum);
+
+/// the latest reading as the ADM1177 sends it; false before the first one
+bool power_monitor_raw(uint8_t * out, uint8_t length);
+
+/// copy the cached readings, optionally resetting the window and counters
+void power_monitor_read(power_reading_t * out, bool reset);
+
+#endif // _POWER_MONITOR_H_
@@ -0,0 +1,112 @@
+#include <asf.h>
+#include "profile.h"
+
+#ifdef PROFILE
+
+/// Histogram resolution per probe: 16-cycle buckets cover ISR budgets down to
+/// a 0xC5 period of 96, while the SOF hook runs longer, and the main loop
+/// sleeps up to a frame between passes.
+static const uint8_t shifts[PROF_COUNT] = {
+    [PROF_ISR] = 4,
+    [PROF_SOF] = 5,
+    [PROF_LOOP] = 13,
+    [PROF_CAL] = 11,
+    [PROF_BULK] = 6,
+};
+
+static volatile profile_record_t records[PROF_COUNT];
+// the start of a lap, or of a marked wait; a probe times one or the other
+static volatile uint32_t lap_start[PROF_COUNT];
+static volatile bool lap_started[PROF_COUNT];
+
+static void reset_record(uint8_t probe)
+{
+    volatile profile_record_t * r = &records[probe];
+    r->count = 0;
+    r->min = UINT32_MAX;
+    r->max = 0;
+    r->shift = shifts[probe];
+    r->buckets = PROFILE_BUCKETS;
+    for (uint8_t i = 0; i < PROFILE_BUCKETS; i++)
+        r->hist[i] = 0;
+    // the next lap restarts rather than count the time spent reading
+    lap_started[probe] = false;
+}
+
+void profile_init(void)
+{
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+    for (uint8_t p = 0; p < PROF_COUNT; p++)
+        reset_record(p);
+}
+
+/// Called from TC2_Handler, so runs from SRAM like it.
+RAMFUNC void profile_add(profile_probe_t probe, uint32_t cycles)
+{
+    volatile profile_record_t * r = &records[probe];
+    uint32_t bucket = cycles >> r->shift;
+    r->count++;
+    if (cycles < r->min)
+        r->min = cycles;
+    if (cycles > r->max)
+        r->max = cycles;
+    r->hist[Min(bucket, PROFILE_BUCKETS - 1)]++;
+}
+
+void profile_lap(profile_probe_t probe)
+{
+    uint32_t now = DWT->CYCCNT;
+    if (lap_started[probe])
+        profile_add(probe, now - lap_start[probe]);
+    lap_start[probe] = now;
+    lap_started[probe] = true;
+}
+
+/// Called from TC2_Handler too. Marks after the first, before the wait is
+/// recorded, belong to the same wait.
+RAMFUNC void profile_mark(profile_probe_t probe)
+{
+    if (!lap_started[probe]) {
+        lap_start[probe] = DWT->CYCCNT;
+        lap_started[probe] = true;
+    }
+}
+
+/// The mark comes from TC2_Handler, so the snapshot and clear are done with
+/// interrupts off; otherwise a mark landing between them would be lost.
+void profile_since_mark(profile_probe_t probe)
+{
+    irqflags_t flags = cpu_irq_save();
+    uint32_t now = DWT->CYCCNT;
+    bool started = lap_started[probe];
+    uint32_t start = lap_start[probe];
+    lap_started[probe] = false;
+    cpu_irq_restore(flags);
+    if (started)
+        profile_add(probe, now - start);
+}
+
+bool profile_read(uint8_t probe, profile_record_t * out, bool reset)
+{
+    if (probe >= PROF_COUNT)
+        return false;
+    irqflags_t flags = cpu_irq_save();
+    *out = *(const profile_record_t *)&records[probe];
+    if (reset)
+        reset_record(probe);
+    cpu_irq_restore(flags);
+    return true;
+}
+
+#else
+
+void profile_init(void) { }
+
+bool profile_read(uint8_t probe, profile_record_t * out, bool reset)
+{
+    return false;
+}
+
+#endif // PROFILE
@@ -0,0 +1,69 @@
+#ifndef _PROFILE_H_
+#define _PROFILE_H_
+
+#include <asf.h>
+
+/// Cycle-count probes on the sampling ISR, the SOF hook and the main loop,
+/// read with request 0x77, and on IN calibration and the wait for BULK_IRQn.
+/// Built with `make PROFILE=1`; otherwise the probes compile away and the
+/// request stalls.
+///
+/// Cycles come from the DWT cycle counter at the 96MHz core clock, so the
+/// ISR's budget at a given 0xC5 period is 2*period cycles. ISR and SOF
+/// records start after exception entry; loop records are the time between
+/// successive passes of the main loop, including any interrupts in between
+/// and its sleep until the next.
+
+typedef enum {
+    PROF_ISR = 0,       // TC2_Handler
+    PROF_SOF = 1,       // main_sof_action()
+    PROF_LOOP = 2,      // one pass of the main loop
+    PROF_CAL = 3,       // calibrating one IN chunk, request 0xDF
+    PROF_BULK = 4,      // BULK_IRQn pended until its handler runs
+    PROF_COUNT
+} profile_probe_t;
+
+#define PROFILE_BUCKETS 12
+
+/// One probe's record, little-endian. Bucket i counts samples of
+/// (i << shift) to ((i+1) << shift)-1 cycles; the last also counts everything above.
+typedef struct {
+    uint32_t count;
+    uint32_t min;                   // 0xFFFFFFFF until the first sample
+    uint32_t max;
+    uint8_t shift;
+    uint8_t buckets;                // PROFILE_BUCKETS
+    uint16_t reserved;
+    uint32_t hist[PROFILE_BUCKETS];
+} profile_record_t;
+
+/// start the cycle counter and clear the records
+void profile_init(void);
+
+/// copy a probe's record, optionally resetting it; false if profiling is not built in
+bool profile_read(uint8_t probe, profile_record_t * out, bool reset);
+
+#ifdef PROFILE
+
+void profile_add(profile_probe_t probe, uint32_t cycles);
+void profile_lap(profile_probe_t probe);
+void profile_mark(profile_probe_t probe);
+void profile_since_mark(profile_probe_t probe);
+
+#define PROFILE_BEGIN(probe)    uint32_t profile_start_##probe = DWT->CYCCNT
+#define PROFILE_END(probe)      profile_add(probe, DWT->CYCCNT - profile_start_##probe)
+#define PROFILE_LAP(probe)      profile_lap(probe)
+#define PROFILE_MARK(probe)     profile_mark(probe)
+#define PROFILE_SINCE_MARK(probe) profile_since_mark(probe)
+
+#else
+
+#define PROFILE_BEGIN(probe)
+#define PROFILE_END(probe)
+#define PROFILE_LAP(probe)
+#define PROFILE_MARK(probe)
+#define PROFILE_SINCE_MARK(probe)
+
+#endif // PROFILE
+
+#endif // _PROFILE_H_
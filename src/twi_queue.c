@@ -0,0 +1,157 @@
+#include <asf.h>
+#include "twi_queue.h"
+
+typedef struct {
+    uint8_t chip;
+    bool read;
+    uint8_t length;
+    uint8_t * buffer;               // reads
+    uint8_t data[TWI_WRITE_MAX];    // writes
+    twi_done_t done;
+    void * ctx;
+} twi_xfer_t;
+
+// Ring of transactions: submitters add at `tail` with interrupts masked,
+// TWI0_Handler runs the one at `head` and retires it when it ends.
+static twi_xfer_t queue[TWI_QUEUE_DEPTH];
+static volatile uint8_t head;
+static volatile uint8_t tail;
+static uint8_t pos;     // bytes sent or received so far in queue[head]
+
+/// begin the transaction at `head`; interrupts are masked or we are the handler
+static void start(void)
+{
+    twi_xfer_t * x = &queue[head];
+    pos = 0;
+    TWI0->TWI_MMR = TWI_MMR_DADR(x->chip) | (x->read ? TWI_MMR_MREAD : 0);
+    TWI0->TWI_IADR = 0;
+    if (x->read) {
+        // a single byte read needs its STOP requested with the START
+        TWI0->TWI_CR = (x->length == 1) ? (TWI_CR_START | TWI_CR_STOP) : TWI_CR_START;
+        TWI0->TWI_IER = TWI_IER_RXRDY | TWI_IER_NACK;
+    }
+    else {
+        TWI0->TWI_THR = x->data[pos++];
+        TWI0->TWI_IER = TWI_IER_TXRDY | TWI_IER_NACK;
+    }
+}
+
+static void finish(bool ok)
+{
+    twi_xfer_t * x = &queue[head];
+    twi_done_t done = x->done;
+    void * ctx = x->ctx;
+
+    TWI0->TWI_IDR = TWI_IDR_RXRDY | TWI_IDR_TXRDY | TWI_IDR_TXCOMP | TWI_IDR_NACK;
+    head = (head + 1) % TWI_QUEUE_DEPTH;
+    if (done)
+        done(ok, ctx);
+    if (head != tail)
+        start();
+}
+
+/// Step the transaction in progress on the enabled status bits in `sr`.
+/// TWI_SR clears NACK when read, so it is read exactly once per step.
+static void service(uint32_t sr)
+{
+    twi_xfer_t * x = &queue[head];
+
+    if (sr & TWI_SR_NACK) {
+        finish(false);
+        return;
+    }
+    if (sr & TWI_SR_RXRDY) {
+        x->buffer[pos++] = TWI0->TWI_RHR;
+        // request the STOP while the last byte is still being received
+        if (pos == x->length - 1)
+            TWI0->TWI_CR = TWI_CR_STOP;
+        if (pos == x->length) {
+            TWI0->TWI_IDR = TWI_IDR_RXRDY;
+            TWI0->TWI_IER = TWI_IER_TXCOMP;
+        }
+    }
+    if (sr & TWI_SR_TXRDY) {
+        if (pos < x->length) {
+            TWI0->TWI_THR = x->data[pos++];
+        }
+        else {
+            TWI0->TWI_CR = TWI_CR_STOP;
+            TWI0->TWI_IDR = TWI_IDR_TXRDY;
+            TWI0->TWI_IER = TWI_IER_TXCOMP;
+        }
+    }
+    if (sr & TWI_SR_TXCOMP)
+        finish(true);
+}
+
+void TWI0_Handler(void)
+{
+    service(TWI0->TWI_SR & TWI0->TWI_IMR);
+}
+
+/// Run the state machine from the caller, for waits made where TWI0_Handler
+/// can't preempt.
+static void poll(void)
+{
+    irqflags_t flags = cpu_irq_save();
+    uint32_t sr = TWI0->TWI_SR & TWI0->TWI_IMR;
+    if (sr)
+        service(sr);
+    cpu_irq_restore(flags);
+}
+
+static void submit(const twi_xfer_t * x)
+{
+    while (true) {
+        irqflags_t flags = cpu_irq_save();
+        uint8_t next = (tail + 1) % TWI_QUEUE_DEPTH;
+        if (next != head) {
+            bool idle = (head == tail);
+            queue[tail] = *x;
+            tail = next;
+            if (idle)
+                start();
+            cpu_irq_restore(flags);
+            return;
+        }
+        cpu_irq_restore(flags);
+        poll();
+    }
+}
+
+void twi_queue_init(void)
+{
+    TWI0->TWI_IDR = TWI_IDR_RXRDY | TWI_IDR_TXRDY | TWI_IDR_TXCOMP | TWI_IDR_NACK;
+    NVIC_SetPriority(TWI0_IRQn, TWI_IRQ_PRIORITY);
+    NVIC_EnableIRQ(TWI0_IRQn);
+}
+
+void twi_queue_write(uint8_t chip, const uint8_t * data, uint8_t length, twi_done_t done, void * ctx)
+{
+    twi_xfer_t x = {.chip = chip, .read = false, .length = Min(length, TWI_WRITE_MAX),
+                    .done = done, .ctx = ctx};
+    if (x.length == 0) {
+        if (done)
+            done(true, ctx);
+        return;
+    }
+    memcpy(x.data, data, x.length);
+    submit(&x);
+}
+
+void twi_queue_read(uint8_t chip, uint8_t * buffer, uint8_t length, twi_done_t done, void * ctx)
+{
+    twi_xfer_t x = {.chip = chip, .read = true, .length = length, .buffer = buffer,
+                    .done = done, .ctx = ctx};
+    if (length == 0) {
+        if (done)
+            done(true, ctx);
+        return;
+    }
+    submit(&x);
+}
+
+bool twi_queue_idle(void)
+{
+    return head == tail;
+}
@@ -0,0 +1,36 @@
+#ifndef _TWI_QUEUE_H_
+#define _TWI_QUEUE_H_
+
+#include <asf.h>
+
+/// Interrupt-driven TWI0 master. Transactions are queued from any context
+/// and run one after another from TWI0_Handler, so I2C traffic costs the
+/// caller only the time to queue it.
+
+/// Transactions queued at once. A full queue makes the submitter wait.
+#define TWI_QUEUE_DEPTH     8
+
+/// Bytes copied in for each write; reads go straight to the caller's buffer.
+#define TWI_WRITE_MAX       4
+
+/// Below TC2_Handler, which must never wait for I2C, and above the UDPHS
+/// interrupt (ASF's UDD_USB_INT_LEVEL, 5), so a control request that finds
+/// the queue full still sees it drain.
+#define TWI_IRQ_PRIORITY    3
+
+/// Called from TWI0_Handler when a transaction ends; `ok` is false on NACK.
+typedef void (*twi_done_t)(bool ok, void * ctx);
+
+/// enable the interrupt; after twi_master_init()
+void twi_queue_init(void);
+
+/// queue a write of `length` bytes to 7-bit address `chip`
+void twi_queue_write(uint8_t chip, const uint8_t * data, uint8_t length, twi_done_t done, void * ctx);
+
+/// queue a read into `buffer`, which must stay valid until `done`
+void twi_queue_read(uint8_t chip, uint8_t * buffer, uint8_t length, twi_done_t done, void * ctx);
+
+/// true when nothing is queued or in progress
+bool twi_queue_idle(void);
+
+#endif // _TWI_QUEUE_H_